@@ -0,0 +1,88 @@
+#pragma once
+
+/*
+ * Interface between protogen and templates translated to C++ by
+ * protogen --compileTemplate. Generated source includes only this header,
+ * so shared object built from it doesn't depend on protogen internals.
+ */
+
+#include <string>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "SymbolTable.hpp"
+#include "OutputSink.hpp"
+
+namespace protogen {
+
+//increase when this interface or semantics of generated code change
+const int compiledTemplateAbi = 1;
+
+//variables of entity being generated, implemented by protogen
+class ITemplateContext {
+public:
+    virtual ~ITemplateContext() = default;
+
+    virtual const std::string& getVar(SymbolId id) = 0;
+    virtual bool getBool(SymbolId id) = 0;
+    virtual bool haveVar(SymbolId id) = 0;
+    virtual bool loopNext(SymbolId id) = 0;
+    virtual void setVar(SymbolId id, const std::string& value) = 0;
+    virtual void setBool(SymbolId id, bool value) = 0;
+    //same whitespace compaction as $pack$ of interpreter
+    virtual void pack(std::string& str) = 0;
+    //report exception thrown by template command at position of that command, never returns
+    virtual void fail(const char* msg, int fidx, int line, int col) = 0;
+};
+
+/*
+ * Description of compiled template.
+ * symbols are interned by protogen, render gets their ids in the same order.
+ * sourceHash is hash of content of all template files, compiled template is
+ * used only if it matches template being loaded.
+ */
+struct CompiledTemplateInfo {
+    int abi;
+    const char* fileName;
+    uint64_t sourceHash;
+    int symbolsCount;
+    const char* const* symbols;
+    void (*render)(ITemplateContext& ctx, const SymbolId* sym, IOutputSink& out);
+};
+
+//name of function exported by compiled template
+#define PROTOGEN_COMPILED_TEMPLATE_FUNC "protogen_compiled_template"
+
+typedef const CompiledTemplateInfo* (*CompiledTemplateFunc)();
+
+namespace compiled {
+
+inline std::string ucFirst(std::string val)
+{
+    if(val.length())
+    {
+        val[0] = toupper(val[0]);
+    }
+    return val;
+}
+
+inline std::string upperCase(std::string val)
+{
+    for(std::string::size_type i = 0; i < val.length(); i++)
+    {
+        val[i] = toupper(val[i]);
+    }
+    return val;
+}
+
+inline std::string hexValue(const std::string& val)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "0x%x", atoi(val.c_str()));
+    return buf;
+}
+
+} // namespace compiled
+
+} // namespace protogen
@@ -1,9 +1,15 @@
 #pragma once
 
 #include <map>
-#include <list>
+#include <deque>
+#include <functional>
 #include <string>
+#include <vector>
+#include <stdint.h>
+#include <unordered_map>
 #include "kst/Throw.hpp"
+#include "SymbolTable.hpp"
+#include "Utility.hpp"
 
 namespace protogen {
 
@@ -13,149 +19,109 @@ struct DataSource {
         top = &global;
     }
 
-    typedef std::map<std::string, std::string> VarMap;
-    typedef std::map<std::string, bool> BoolMap;
+    DataSource(const DataSource& other) : global(other.global)
+    {
+        top = &global;
+    }
+
+    DataSource& operator=(const DataSource& other)
+    {
+        global = other.global;
+        top = &global;
+        return *this;
+    }
+
     struct Loop;
-    typedef std::map<std::string, Loop> LoopMap;
+    typedef std::map<SymbolId, Loop> LoopMap;
 
     struct Namespace {
-        Namespace() : parent(nullptr)
+        Namespace() : parentSym(SymbolTable::emptyId), parent(nullptr)
         {
         }
 
-        explicit Namespace(const std::string& argParentName) : parentName(argParentName), parent(nullptr)
+        explicit Namespace(const std::string& argParentName) : parentName(argParentName),
+                parentSym(SymbolTable::intern(argParentName)), parent(nullptr)
         {
         }
 
-        VarMap vars;
-        BoolMap bools;
+        Namespace(const std::string& argParentName, SymbolId argParentSym) : parentName(argParentName),
+                parentSym(argParentSym), parent(nullptr)
+        {
+        }
+
+        //indexed by SymbolId, index into values or -1
+        std::vector<int> varSlots;
+        std::vector<std::string> values;
+        //indexed by SymbolId, 0 - false, 1 - true, -1 - not set
+        std::vector<signed char> boolSlots;
         LoopMap loops;
         std::string parentName;
+        SymbolId parentSym;
         Namespace* parent;
 
-        const std::string& getVar(const std::string& name) const
+        const std::string* findVar(SymbolId id) const
         {
-            VarMap::const_iterator it;
-            if(!name.empty() && name[0] == '.')
-            {
-                //printFmt("getVar %s\n",parentName+name);
-                it = vars.find(parentName + name);
-            }
-            else
-            {
-                it = vars.find(name);
-            }
-            if(it == vars.end())
+            if(static_cast<size_t>(id) < varSlots.size() && varSlots[id] >= 0)
             {
-                if(parent)
-                {
-                    return parent->getVar(name);
-                }
-                else
-                {
-                    KSTHROW("Template var not found:%s", name);
-                }
+                return &values[varSlots[id]];
             }
-            return it->second;
+            return nullptr;
         }
 
-        bool getBool(const std::string& name) const
+        signed char findBool(SymbolId id) const
         {
-            BoolMap::const_iterator it;
-            if(!name.empty() && name[0] == '.')
-            {
-                it = bools.find(parentName + name);
-            }
-            else
-            {
-                it = bools.find(name);
-            }
-            if(it == bools.end())
-            {
-                if(parent)
-                {
-                    return parent->getBool(name);
-                }
-                else
-                {
-                    KSTHROW("Template bool not found:%s", name);
-                }
-            }
-            return it->second;
-        }
-
-        bool haveVar(const std::string& name) const
-        {
-            bool rv = vars.find(name) != vars.end() || bools.find(name) != bools.end();
-            if(!rv && parent)
-            {
-                rv = parent->haveVar(name);
-            }
-            return rv;
+            return static_cast<size_t>(id) < boolSlots.size() ? boolSlots[id] : -1;
         }
 
-        void setBool(const std::string& name, bool value)
+        Loop* findLoop(SymbolId id)
         {
-            bools[name] = value;
+            LoopMap::iterator it = loops.find(id);
+            return it == loops.end() ? nullptr : &it->second;
         }
 
-        bool loopNext(const std::string& name)
+        void setVar(SymbolId id, const std::string& val)
         {
-            LoopMap::iterator it = loops.find(name);
-            if(it == loops.end())
+            if(static_cast<size_t>(id) >= varSlots.size())
             {
-                KSTHROW("Template loop not found:%s", name);
+                varSlots.resize(id + 1, -1);
             }
-            return it->second.next();
-        }
-
-        Loop& getLoop(const std::string& name)
-        {
-            LoopMap::iterator it;
-            if(!name.empty() && name[0] == '.')
+            if(varSlots[id] < 0)
             {
-                it = loops.find(parentName + name);
+                varSlots[id] = static_cast<int>(values.size());
+                values.push_back(val);
             }
             else
             {
-                it = loops.find(name);
+                values[varSlots[id]] = val;
             }
-            if(it == loops.end())
+        }
+
+        void setBool(SymbolId id, bool value)
+        {
+            if(static_cast<size_t>(id) >= boolSlots.size())
             {
-                if(parent)
-                {
-                    return parent->getLoop(name);
-                }
-                else
-                {
-                    KSTHROW("Template loop not found:%s", name);
-                }
+                boolSlots.resize(id + 1, -1);
             }
-            return it->second;
+            boolSlots[id] = value ? 1 : 0;
+        }
+
+        void setBool(const std::string& name, bool value)
+        {
+            setBool(SymbolTable::intern(name), value);
         }
 
         Loop& createLoop(const std::string& name, bool doClear = true)
         {
-            if(parentName.empty())
+            std::string fullName = parentName.empty() ? name : parentName + "." + name;
+            SymbolId id = SymbolTable::intern(fullName);
+            Loop& rv = loops[id];
+            if(doClear)
             {
-                Loop& rv = loops[name];
-                if(doClear)
-                {
-                    rv.clear();
-                }
-                rv.name = name;
-                return rv;
-            }
-            else
-            {
-                Loop& rv = loops[parentName + "." + name];
-                if(doClear)
-                {
-                    rv.clear();
-                }
-                rv.name = parentName + "." + name;
-                return rv;
+                rv.clear();
             }
+            rv.name = fullName;
+            rv.nameSym = id;
+            return rv;
         }
 
 
@@ -163,28 +129,28 @@ struct DataSource {
         {
             if(parentName.empty() || name.find('.') != std::string::npos)
             {
-                vars[name] = val;
+                setVar(SymbolTable::intern(name), val);
             }
             else
             {
-                vars[parentName + "." + name] = val;
+                setVar(SymbolTable::intern(parentName + "." + name), val);
             }
         }
 
         void addVar(const std::string& val)
         {
-            vars[parentName] = val;
+            setVar(parentSym, val);
         }
 
         void addBool(const std::string& name, bool val)
         {
             if(parentName.empty() || name.find('.') != std::string::npos)
             {
-                bools[name] = val;
+                setBool(SymbolTable::intern(name), val);
             }
             else
             {
-                bools[parentName + "." + name] = val;
+                setBool(SymbolTable::intern(parentName + "." + name), val);
             }
         }
 
@@ -196,20 +162,42 @@ struct DataSource {
         }
 
         std::string name;
-        std::list<Namespace> items;
-        std::list<Namespace>::iterator current;
+        SymbolId nameSym = SymbolTable::emptyId;
+        //deque keeps item addresses stable while the loop grows
+        std::deque<Namespace> items;
+        size_t current = 0;
         bool started;
         bool first;
+        //fills items on first iteration, so loops the template never reads cost nothing
+        std::function<void(Loop&)> populate;
+
+        void setName(const std::string& argName)
+        {
+            name = argName;
+            nameSym = SymbolTable::intern(argName);
+        }
+
+        void fill()
+        {
+            if(populate)
+            {
+                std::function<void(Loop&)> func;
+                func.swap(populate);
+                func(*this);
+            }
+        }
 
         void init()
         {
-            current = items.begin();
+            fill();
+            current = 0;
             started = true;
             first = true;
         }
 
         void clear()
         {
+            populate = nullptr;
             items.clear();
             started = false;
             first = false;
@@ -217,7 +205,7 @@ struct DataSource {
 
         Namespace* get()
         {
-            return &*current;
+            return &items[current];
         }
 
         bool next()
@@ -230,7 +218,7 @@ struct DataSource {
             {
                 first = false;
             }
-            bool rv = current != items.end();
+            bool rv = current < items.size();
             if(!rv)
             {
                 started = false;
@@ -247,15 +235,9 @@ struct DataSource {
 
             if(idx == items.size())
             {
-                items.push_back(Namespace());
-                return items.back();
-            }
-            else
-            {
-                std::list<Namespace>::iterator it = items.begin();
-                std::advance(it, idx);
-                return *it;
+                items.emplace_back();
             }
+            return items[idx];
         }
 
         Namespace& newItem()
@@ -265,7 +247,7 @@ struct DataSource {
             {
                 items.back().addBool("last", false);
             }
-            items.push_back(Namespace(name));
+            items.emplace_back(name, nameSym);
             items.back().addBool("first", first);
             items.back().addBool("last", true);
             return items.back();
@@ -275,29 +257,71 @@ struct DataSource {
     Namespace global;
     Namespace* top;
 
-    const std::string& getVar(const std::string& name)
+    const std::string& getVar(SymbolId id)
     {
-        return top->getVar(name);
+        for(Namespace* ns = top; ns; ns = ns->parent)
+        {
+            const std::string* rv = ns->findVar(resolve(ns, id));
+            if(rv)
+            {
+                return *rv;
+            }
+        }
+        KSTHROW("Template var not found:%s", SymbolTable::name(id));
     }
 
-    bool getBool(const std::string& name)
+    bool getBool(SymbolId id)
     {
-        return top->getBool(name);
+        for(Namespace* ns = top; ns; ns = ns->parent)
+        {
+            signed char rv = ns->findBool(resolve(ns, id));
+            if(rv >= 0)
+            {
+                return rv != 0;
+            }
+        }
+        KSTHROW("Template bool not found:%s", SymbolTable::name(id));
     }
 
-    bool haveVar(const std::string& name)
+    bool haveVar(SymbolId id)
     {
-        return top->haveVar(name);
+        id = SymbolTable::absolute(id);
+        for(Namespace* ns = top; ns; ns = ns->parent)
+        {
+            if(ns->findVar(id) || ns->findBool(id) >= 0)
+            {
+                return true;
+            }
+        }
+        return false;
     }
 
-    void setBool(const std::string& name, bool value)
+    void setBool(SymbolId id, bool value)
     {
-        global.setBool(name, value);
+        global.setBool(SymbolTable::absolute(id), value);
     }
 
-    bool loopNext(const std::string& name)
+    void setVar(SymbolId id, const std::string& val)
+    {
+        global.setVar(SymbolTable::absolute(id), val);
+    }
+
+    Loop& getLoop(SymbolId id)
+    {
+        for(Namespace* ns = top; ns; ns = ns->parent)
+        {
+            Loop* rv = ns->findLoop(resolve(ns, id));
+            if(rv)
+            {
+                return *rv;
+            }
+        }
+        KSTHROW("Template loop not found:%s", SymbolTable::name(id));
+    }
+
+    bool loopNext(SymbolId id)
     {
-        Loop& l = top->getLoop(name);
+        Loop& l = getLoop(id);
         if(!l.started)
         {
             l.init();
@@ -328,9 +352,34 @@ struct DataSource {
         return rv;
     }
 
+    const std::string& getVar(const std::string& name)
+    {
+        return getVar(SymbolTable::lookupId(name));
+    }
+
+    bool getBool(const std::string& name)
+    {
+        return getBool(SymbolTable::lookupId(name));
+    }
+
+    bool haveVar(const std::string& name)
+    {
+        return haveVar(SymbolTable::lookupId(name));
+    }
+
+    void setBool(const std::string& name, bool value)
+    {
+        setBool(SymbolTable::intern(name), value);
+    }
+
+    bool loopNext(const std::string& name)
+    {
+        return loopNext(SymbolTable::lookupId(name));
+    }
+
     void setVar(const std::string& name, const std::string& val)
     {
-        global.vars[name] = val;
+        setVar(SymbolTable::intern(name), val);
     }
 
     Loop& createLoop(const std::string& name, bool doClear = true)
@@ -338,6 +387,71 @@ struct DataSource {
         return global.createLoop(name, doClear);
     }
 
+    //hash of all variables, bools and loop items, lazy loops are populated for it
+    uint64_t contentHash()
+    {
+        return namespaceHash(global);
+    }
+
+protected:
+    //entries are combined by addition, so the result doesn't depend on order of symbol ids
+    static uint64_t namespaceHash(Namespace& ns)
+    {
+        uint64_t rv = 0;
+        for(size_t id = 0; id < ns.varSlots.size(); id++)
+        {
+            if(ns.varSlots[id] >= 0)
+            {
+                uint64_t nameHash = hashMix(hashString(SymbolTable::name(static_cast<SymbolId>(id))));
+                rv += hashMix(nameHash + hashString(ns.values[ns.varSlots[id]]));
+            }
+        }
+        for(size_t id = 0; id < ns.boolSlots.size(); id++)
+        {
+            if(ns.boolSlots[id] >= 0)
+            {
+                uint64_t nameHash = hashMix(hashString(SymbolTable::name(static_cast<SymbolId>(id))));
+                rv += hashMix(nameHash + 2 + ns.boolSlots[id]);
+            }
+        }
+        for(auto& it : ns.loops)
+        {
+            Loop& loop = it.second;
+            loop.fill();
+            uint64_t loopHash = hashString(SymbolTable::name(it.first));
+            for(auto& item : loop.items)
+            {
+                loopHash = hashMix(loopHash + namespaceHash(item));
+            }
+            rv += hashMix(loopHash);
+        }
+        return rv;
+    }
+
+    //relative names (.name) are looked up as parentName + name in each namespace
+    typedef std::unordered_map<uint64_t, SymbolId> JoinCache;
+    JoinCache joinCache;
+
+    SymbolId resolve(const Namespace* ns, SymbolId id)
+    {
+        if(!SymbolTable::isRelative(id))
+        {
+            return id;
+        }
+        id = SymbolTable::absolute(id);
+        if(ns->parentName.empty())
+        {
+            return id;
+        }
+        uint64_t key = (static_cast<uint64_t>(ns->parentSym) << 32) | static_cast<uint32_t>(id);
+        JoinCache::iterator it = joinCache.find(key);
+        if(it == joinCache.end())
+        {
+            it = joinCache.emplace(key, SymbolTable::intern(ns->parentName + SymbolTable::name(id))).first;
+        }
+        return it->second;
+    }
+
 };
 
 } // namespace protogen
@@ -4,8 +4,14 @@
 #include <string>
 #include <stdexcept>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 namespace protogen {
 
@@ -14,6 +20,7 @@ typedef std::vector<std::string> StrVector;
 struct FileReader {
 
     std::vector<char> source;
+    const char* data = nullptr;
     std::string fileName;
     size_t fileSize = 0;
     size_t pos = 0;
@@ -21,10 +28,47 @@ struct FileReader {
     size_t col = 1;
     int file = 0;
     bool nextLine = false;
+    //no CR in the input, bulk scans can skip newline translation
+    bool lfOnly = true;
+
+    FileReader() = default;
+
+    FileReader(const FileReader&) = delete;
+    FileReader& operator=(const FileReader&) = delete;
+
+    ~FileReader()
+    {
+#ifndef _WIN32
+        if(data && data != source.data())
+        {
+            munmap(const_cast<char*>(data), fileSize);
+        }
+#endif
+    }
 
     void Open(const std::string& argFileName)
     {
         fileName = argFileName;
+#ifndef _WIN32
+        int fd = open(fileName.c_str(), O_RDONLY);
+        struct stat st = {};
+        if(fd != -1 && fstat(fd, &st) == 0)
+        {
+            fileSize = static_cast<size_t>(st.st_size);
+            void* ptr = fileSize ? mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+            close(fd);
+            if(ptr != MAP_FAILED)
+            {
+                data = static_cast<const char*>(ptr);
+                lfOnly = memchr(data, 0x0d, fileSize) == nullptr;
+                return;
+            }
+        }
+        else if(fd != -1)
+        {
+            close(fd);
+        }
+#endif
         FILE* f = fopen(fileName.c_str(), "rb");
         if(!f)
         {
@@ -37,8 +81,22 @@ struct FileReader {
         fileSize = static_cast<size_t>(ftell(f));
         fseek(f, 0, SEEK_SET);
         source.resize(fileSize);
-        fread(&source[0], fileSize, 1, f);
+        if(fileSize)
+        {
+            fread(&source[0], fileSize, 1, f);
+        }
         fclose(f);
+        data = source.data();
+        lfOnly = memchr(data, 0x0d, fileSize) == nullptr;
+    }
+
+    void Assign(const std::string& argFileName, const std::string& text)
+    {
+        fileName = argFileName;
+        source.assign(text.begin(), text.end());
+        data = source.data();
+        fileSize = source.size();
+        lfOnly = memchr(data, 0x0d, fileSize) == nullptr;
     }
 
     char getChar()
@@ -53,12 +111,12 @@ struct FileReader {
             col = 1;
             nextLine = false;
         }
-        char rv = source[pos++];
+        char rv = data[pos++];
         if(rv == 0x0d || rv == 0x0a)
         {
             if(rv == 0x0d && pos < fileSize)
             {
-                rv = source[pos++];
+                rv = data[pos++];
                 if(rv != 0x0a)
                 {
                     pos--;
@@ -71,6 +129,11 @@ struct FileReader {
         return rv;
     }
 
+    char peekChar() const
+    {
+        return data[pos] == 0x0d ? 0x0a : data[pos];
+    }
+
     void putChar()
     {
         pos--;
@@ -81,6 +144,53 @@ struct FileReader {
     {
         return pos >= fileSize;
     }
+
+    /*
+     * Consume characters while pred(c) is true, line and col are updated
+     * once per scan instead of once per character.
+     * Returns number of consumed characters.
+     */
+    template<class Pred>
+    size_t skipWhile(Pred pred)
+    {
+        size_t start = pos;
+        if(!lfOnly)
+        {
+            while(!eof() && pred(peekChar()))
+            {
+                getChar();
+            }
+            return pos - start;
+        }
+        size_t end = pos;
+        while(end < fileSize && pred(data[end]))
+        {
+            end++;
+        }
+        advance(end);
+        return end - start;
+    }
+
+    //same as skipWhile, but consumed characters are appended to out
+    template<class Pred>
+    size_t readWhile(Pred pred, std::string& out)
+    {
+        if(!lfOnly)
+        {
+            size_t cnt = 0;
+            while(!eof() && pred(peekChar()))
+            {
+                out += getChar();
+                cnt++;
+            }
+            return cnt;
+        }
+        size_t start = pos;
+        size_t cnt = skipWhile(pred);
+        out.append(data + start, cnt);
+        return cnt;
+    }
+
     static std::string findFile(const StrVector& searchPath, const std::string& fileName, bool searchInCurDir = true)
     {
         if(fileName.length() && fileName[0] == '/')
@@ -105,6 +215,38 @@ struct FileReader {
         }
         return fileName;
     }
+
+protected:
+    //move pos to end keeping line/col as if getChar was called for each character
+    void advance(size_t end)
+    {
+        if(end == pos)
+        {
+            return;
+        }
+        if(nextLine)
+        {
+            line++;
+            col = 1;
+            nextLine = false;
+        }
+        const char* p = data + pos;
+        const char* e = data + end;
+        pos = end;
+        while(const char* nl = static_cast<const char*>(memchr(p, 0x0a, e - p)))
+        {
+            col += nl - p;
+            p = nl + 1;
+            if(p == e)
+            {
+                nextLine = true;
+                return;
+            }
+            line++;
+            col = 1;
+        }
+        col += e - p;
+    }
 };
 
 } // namespace protogen
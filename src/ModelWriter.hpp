@@ -0,0 +1,182 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include "Parser.hpp"
+
+namespace protogen {
+
+/*
+ * Binary serialization of parsed model, used by schema cache and
+ * for hashing of entity inputs.
+ */
+class ModelWriter {
+public:
+    std::string buf;
+    //shared property definitions are written once, then referenced by index
+    std::unordered_map<const Property*, uint32_t> propIndex;
+
+    void write(uint32_t value)
+    {
+        buf.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void write(uint64_t value)
+    {
+        buf.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void write(int value)
+    {
+        write(static_cast<uint32_t>(value));
+    }
+
+    void write(bool value)
+    {
+        write(static_cast<uint32_t>(value));
+    }
+
+    void write(const std::string& value)
+    {
+        write(static_cast<uint32_t>(value.length()));
+        buf += value;
+    }
+
+    void write(const PropertyField& pf)
+    {
+        write(static_cast<int>(pf.pt));
+        write(pf.name);
+        write(pf.pt == ptBool && pf.boolValue);
+        write(pf.pt == ptInt ? pf.intValue : 0);
+        write(pf.strValue);
+    }
+
+    void write(const PropertyPtr& p)
+    {
+        auto res = propIndex.emplace(p.get(), static_cast<uint32_t>(propIndex.size()));
+        write(res.first->second);
+        if(res.second)
+        {
+            write(p->name);
+            write(static_cast<int>(p->pt));
+            write(static_cast<int>(p->def));
+            write(p->fields);
+        }
+    }
+
+    void write(const PropertyUse& pu)
+    {
+        write(pu.def);
+        write(pu.haveValue);
+        if(pu.haveValue)
+        {
+            write(pu.value);
+        }
+    }
+
+    void write(const TypeDef& td)
+    {
+        write(td.typeName);
+        write(static_cast<int>(td.tk));
+        write(td.properties);
+        write(td.genericParamNames);
+    }
+
+    void write(const Field& f)
+    {
+        write(f.ft.typeName);
+        write(static_cast<int>(f.ft.fk));
+        write(f.ft.genericParamsValues);
+        write(f.name);
+        write(f.fsname);
+        write(f.tag);
+        write(f.properties);
+    }
+
+    void write(const FieldSet& fs)
+    {
+        write(fs.name);
+        write(fs.pkg);
+        write(fs.fields);
+        write(fs.properties);
+        write(fs.used);
+    }
+
+    void write(const Message& msg)
+    {
+        write(msg.name);
+        write(msg.pkg);
+        write(msg.parent);
+        write(static_cast<int>(msg.majorVersion));
+        write(static_cast<int>(msg.minorVersion));
+        write(msg.fields);
+        write(msg.properties);
+        write(msg.tag);
+        write(msg.haveTag);
+    }
+
+    void write(const Protocol::MessageRecord& mr)
+    {
+        write(mr.msgName);
+        write(mr.props);
+    }
+
+    void write(const Protocol& proto)
+    {
+        write(proto.name);
+        write(proto.pkg);
+        write(proto.messages);
+    }
+
+    void write(const Enum::EnumValue& ev)
+    {
+        write(ev.name);
+        write(ev.strVal);
+        write(ev.intVal);
+    }
+
+    void write(const Enum& e)
+    {
+        write(e.name);
+        write(e.typeName);
+        write(e.pkg);
+        write(e.properties);
+        write(static_cast<int>(e.vt));
+        write(e.values);
+    }
+
+    template<class T>
+    void write(const std::vector<T>& items)
+    {
+        write(static_cast<uint32_t>(items.size()));
+        for(const auto& item : items)
+        {
+            write(item);
+        }
+    }
+
+    template<class T>
+    void write(const std::list<T>& items)
+    {
+        write(static_cast<uint32_t>(items.size()));
+        for(const auto& item : items)
+        {
+            write(item);
+        }
+    }
+
+    //keys are duplicated in values for all maps
+    template<class T>
+    void write(const std::map<std::string, T>& items)
+    {
+        write(static_cast<uint32_t>(items.size()));
+        for(const auto& item : items)
+        {
+            write(item.first);
+            write(item.second);
+        }
+    }
+};
+
+} // namespace protogen
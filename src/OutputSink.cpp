@@ -0,0 +1,145 @@
+#include "OutputSink.hpp"
+#include "Profiler.hpp"
+#include <string.h>
+
+namespace protogen {
+
+static const size_t outputBufferSize = 64 * 1024;
+
+FileOutputSink::FileOutputSink(const std::string& argFileName, bool keepUnchanged, const std::string& tmpSuffix) :
+    fileName(argFileName), tmpFileName(argFileName + tmpSuffix)
+{
+    buf.reserve(outputBufferSize);
+    if(keepUnchanged)
+    {
+        existing = fopen(fileName.c_str(), "rb");
+    }
+    if(!existing)
+    {
+        openOutput();
+    }
+}
+
+FileOutputSink::~FileOutputSink()
+{
+    if(existing)
+    {
+        fclose(existing);
+    }
+    if(out)
+    {
+        fclose(out);
+        remove(tmpFileName.c_str());
+    }
+}
+
+void FileOutputSink::write(const char* data, size_t size)
+{
+    if(!error.empty())
+    {
+        return;
+    }
+    buf.insert(buf.end(), data, data + size);
+    if(buf.size() >= outputBufferSize)
+    {
+        flush();
+    }
+}
+
+bool FileOutputSink::openOutput()
+{
+    out = fopen(tmpFileName.c_str(), "wb");
+    if(!out)
+    {
+        error = "Failed to open file '" + tmpFileName + "' for writing";
+        return false;
+    }
+    if(existing)
+    {
+        //copy the part that matched so far
+        rewind(existing);
+        cmpBuf.resize(outputBufferSize);
+        size_t left = matched;
+        while(left)
+        {
+            size_t chunk = left < cmpBuf.size() ? left : cmpBuf.size();
+            if(fread(&cmpBuf[0], chunk, 1, existing) != 1 || fwrite(&cmpBuf[0], chunk, 1, out) != 1)
+            {
+                error = "Failed to write file '" + tmpFileName + "'";
+                return false;
+            }
+            left -= chunk;
+        }
+        fclose(existing);
+        existing = nullptr;
+    }
+    return true;
+}
+
+void FileOutputSink::flush()
+{
+    if(buf.empty() || !error.empty())
+    {
+        return;
+    }
+    if(existing)
+    {
+        cmpBuf.resize(buf.size());
+        if(fread(&cmpBuf[0], 1, buf.size(), existing) == buf.size() && memcmp(&cmpBuf[0], &buf[0], buf.size()) == 0)
+        {
+            matched += buf.size();
+            buf.clear();
+            return;
+        }
+        if(!openOutput())
+        {
+            return;
+        }
+    }
+    if(fwrite(&buf[0], buf.size(), 1, out) != 1)
+    {
+        error = "Failed to write file '" + tmpFileName + "'";
+    }
+    buf.clear();
+}
+
+bool FileOutputSink::commit()
+{
+    ProfileScope profile("write", fileName);
+    flush();
+    if(existing && error.empty())
+    {
+        if(fgetc(existing) == EOF)
+        {
+            fclose(existing);
+            existing = nullptr;
+            unchanged = true;
+            return true;
+        }
+        openOutput();
+    }
+    if(!error.empty())
+    {
+        return false;
+    }
+    FILE* f = out;
+    out = nullptr;
+    if(fclose(f) != 0)
+    {
+        error = "Failed to write file '" + tmpFileName + "'";
+        remove(tmpFileName.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    remove(fileName.c_str());
+#endif
+    if(rename(tmpFileName.c_str(), fileName.c_str()) != 0)
+    {
+        error = "Failed to rename '" + tmpFileName + "' to '" + fileName + "'";
+        remove(tmpFileName.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace protogen
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace protogen {
+
+class IOutputSink {
+public:
+    virtual ~IOutputSink() = default;
+
+    virtual void write(const char* data, size_t size) = 0;
+
+    void write(const std::string& str)
+    {
+        write(str.c_str(), str.length());
+    }
+};
+
+class StringOutputSink : public IOutputSink {
+public:
+    void write(const char* data, size_t size) override
+    {
+        str.append(data, size);
+    }
+
+    std::string str;
+};
+
+class NullOutputSink : public IOutputSink {
+public:
+    void write(const char* data, size_t size) override
+    {
+    }
+};
+
+/*
+ * Buffered writer to a temporary file that replaces the target on commit.
+ * With keepUnchanged output is compared against the existing file first
+ * and nothing is written as long as it matches.
+ * Temporary file is named fileName + tmpSuffix, files that can be written
+ * by several processes at once need unique suffix.
+ */
+class FileOutputSink : public IOutputSink {
+public:
+    FileOutputSink(const std::string& argFileName, bool keepUnchanged, const std::string& tmpSuffix = ".tmp");
+    ~FileOutputSink() override;
+
+    FileOutputSink(const FileOutputSink&) = delete;
+    FileOutputSink& operator=(const FileOutputSink&) = delete;
+
+    void write(const char* data, size_t size) override;
+
+    bool commit();
+
+    bool isUnchanged() const
+    {
+        return unchanged;
+    }
+
+    const std::string& getError() const
+    {
+        return error;
+    }
+
+protected:
+    void flush();
+    bool openOutput();
+
+    std::string fileName;
+    std::string tmpFileName;
+    FILE* existing = nullptr;
+    FILE* out = nullptr;
+    std::vector<char> buf;
+    std::vector<char> cmpBuf;
+    size_t matched = 0;
+    bool unchanged = false;
+    std::string error;
+};
+
+} // namespace protogen
@@ -1,8 +1,12 @@
 #include "Parser.hpp"
+#include "Profiler.hpp"
 #include <stdio.h>
 #include <stdexcept>
 #include <ctype.h>
 #include <stdlib.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace protogen {
 
@@ -109,11 +113,11 @@ TokenType findKeyword(const std::string& str)
 }//namespace
 
 
-const Parser::Token& Parser::expect(TokensList::iterator& it, const TokenTypeList& ttl)
+const Parser::Token& Parser::expect(TokensVector::iterator& it, const TokenTypeList& ttl)
 {
     it++;
     const TokenTypeList* node = &ttl;
-    while(node && it != tokens.end())
+    while(node)
     {
         if(it->tt == node->tt)
         {
@@ -137,7 +141,7 @@ const Parser::Token& Parser::expect(TokensList::iterator& it, const TokenTypeLis
             it->line, it->col);
 }
 
-bool Parser::advanceIf(TokensList::iterator& it, TokenType tt)
+bool Parser::advanceIf(TokensVector::iterator& it, TokenType tt)
 {
     auto next = it;
     ++next;
@@ -149,22 +153,181 @@ bool Parser::advanceIf(TokensList::iterator& it, TokenType tt)
     return false;
 }
 
-void Parser::parseFile(const char* fileName)
+StrRef Parser::ownValue(SourceFile& sf, std::string value)
 {
-    std::string foundFile = FileReader::findFile(searchPath, fileName, searchInCurDir);
-    for(auto& file : files)
+    sf.strings.push_back(std::move(value));
+    return StrRef(sf.strings.back().c_str(), sf.strings.back().length());
+}
+
+StrRef Parser::sourceValue(SourceFile& sf, size_t start, size_t end)
+{
+    const FileReader& fr = sf.fr;
+    const char* ptr = fr.data + start;
+    if(fr.lfOnly || !memchr(ptr, 0x0d, end - start))
+    {
+        return StrRef(ptr, end - start);
+    }
+    //same newline translation as FileReader::getChar
+    std::string value;
+    for(size_t i = start; i < end; i++)
     {
-        if(foundFile == file)
+        if(fr.data[i] == 0x0d)
+        {
+            value += '\x0a';
+            if(i + 1 < end && fr.data[i + 1] == 0x0a)
+            {
+                i++;
+            }
+        }
+        else
         {
-            return;
+            value += fr.data[i];
         }
     }
+    return ownValue(sf, std::move(value));
+}
+
+//the same file can be included by different relative paths
+std::string Parser::fileKey(const std::string& path)
+{
+#ifndef _WIN32
+    struct stat st = {};
+    if(::stat(path.c_str(), &st) == 0)
+    {
+        return std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino);
+    }
+#endif
+    return path;
+}
+
+Parser::TokensVector* Parser::lexFile(const char* fileName)
+{
+    std::string foundFile = FileReader::findFile(searchPath, fileName, searchInCurDir);
+    if(!fileKeys.insert(fileKey(foundFile)).second)
+    {
+        return nullptr;
+    }
     //printf("parsing:%s\n",foundFile.c_str());
 
-    FileReader fr;
-    fr.Open(foundFile);
-    fr.file = files.size();
+    std::unique_ptr<SourceFile>& sf = sources[foundFile];
+    if(!sf)
+    {
+        sf.reset(new SourceFile(foundFile));
+        lexSource(*sf);
+    }
+    else if(sf->error)
+    {
+        std::rethrow_exception(sf->error);
+    }
+    //files are numbered in include order, no matter in which order they were lexed
+    int file = static_cast<int>(files.size());
     files.push_back(foundFile);
+    for(auto& token : sf->tokens)
+    {
+        token.file = file;
+    }
+    return &sf->tokens;
+}
+
+StrVector Parser::findIncludes(const SourceFile& sf) const
+{
+    StrVector rv;
+    const TokensVector& tokens = sf.tokens;
+    for(size_t i = 0; i + 1 < tokens.size(); i++)
+    {
+        if(tokens[i].tt == ttInclude && (tokens[i + 1].tt == ttIdent || tokens[i + 1].tt == ttFileName))
+        {
+            std::string foundFile = FileReader::findFile(searchPath, tokens[i + 1].value, searchInCurDir);
+            if(fileKeys.find(fileKey(foundFile)) == fileKeys.end())
+            {
+                rv.push_back(foundFile);
+            }
+        }
+    }
+    return rv;
+}
+
+/*
+ * Lex the whole include tree of root on a pool of threads.
+ * Includes are only collected here, parseFile still processes them
+ * in order and reports lexing errors when it reaches them.
+ */
+void Parser::prelexIncludes(const SourceFile& root)
+{
+    if(jobs <= 1)
+    {
+        return;
+    }
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<SourceFile*> queue;
+    size_t active = 0;
+    auto enqueue = [this, &queue](const StrVector& includes)
+    {
+        for(auto& include : includes)
+        {
+            std::unique_ptr<SourceFile>& sf = sources[include];
+            if(!sf)
+            {
+                sf.reset(new SourceFile(include));
+                queue.push_back(sf.get());
+            }
+        }
+    };
+    enqueue(findIncludes(root));
+    if(queue.empty())
+    {
+        return;
+    }
+    auto worker = [this, &mtx, &cv, &queue, &active, &enqueue]()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        for(;;)
+        {
+            cv.wait(lock, [&queue, &active]() { return !queue.empty() || active == 0; });
+            if(queue.empty())
+            {
+                return;
+            }
+            SourceFile* sf = queue.front();
+            queue.pop_front();
+            active++;
+            lock.unlock();
+            StrVector includes;
+            try
+            {
+                lexSource(*sf);
+                includes = findIncludes(*sf);
+            }
+            catch(...)
+            {
+                sf->error = std::current_exception();
+            }
+            lock.lock();
+            enqueue(includes);
+            active--;
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for(size_t i = 1; i < jobs; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for(auto& t : threads)
+    {
+        t.join();
+    }
+}
+
+void Parser::lexSource(SourceFile& sf)
+{
+    const std::string& foundFile = sf.fileName;
+    FileReader& fr = sf.fr;
+    fr.Open(foundFile);
+    TokensVector& tokens = sf.tokens;
+    tokens.reserve(fr.fileSize / 4);
     char c;
     bool lineComment = false;
     bool blockComment = false;
@@ -177,21 +340,21 @@ void Parser::parseFile(const char* fileName)
 
         if(lineComment)
         {
-            if(fr.getChar() != 0x0a)
+            if(fr.skipWhile([](char ch) { return ch != 0x0a; }))
             {
                 continue;
             }
-            pushToken(Token(ttEoln, fr.file, line, col));
+            fr.getChar();
+            tokens.emplace_back(ttEoln, fr.file, line, col);
             lineComment = false;
             continue;
         }
         if(blockComment)
         {
-            if(fr.getChar() != '*')
+            if(fr.skipWhile([](char ch) { return ch != '*'; }))
             {
                 continue;
             }
-            fr.putChar();
         }
 
         switch(c = fr.getChar())
@@ -249,6 +412,7 @@ void Parser::parseFile(const char* fileName)
             case '9':
             {
                 TokenType tt = ttIntValue;
+                size_t start = fr.pos - 1;
                 std::string val;
                 val = c;
                 while(!fr.eof() && isdigit(c = fr.getChar()))
@@ -285,11 +449,11 @@ void Parser::parseFile(const char* fileName)
                         throw ParsingException("Broken hex value at ", foundFile, line, col);
                     }
                 }
-                pushToken(Token(tt, fr.file, line, col, val));
+                tokens.emplace_back(tt, fr.file, line, col, StrRef(fr.data + start, val.length()));
 
                 if(c == 0x0a)
                 {
-                    pushToken(Token(ttEoln, fr.file, fr.line, fr.col));
+                    tokens.emplace_back(ttEoln, fr.file, fr.line, fr.col);
                 }
                 else
                 {
@@ -299,126 +463,148 @@ void Parser::parseFile(const char* fileName)
             }
             case '`':
             {
-                std::string val;
-                while(!fr.eof() && (c = fr.getChar()) != '`')
-                {
-                    val += c;
-                }
-                if(c != '`')
+                size_t start = fr.pos;
+                fr.skipWhile([](char ch) { return ch != '`'; });
+                if(fr.eof())
                 {
                     throw ParsingException("Raw identifier wasn't closed at ", foundFile, line, col);
                 }
-                pushToken(Token(ttIdent, fr.file, line, col, val));
+                tokens.emplace_back(ttIdent, fr.file, line, col, sourceValue(sf, start, fr.pos));
+                fr.getChar();
                 break;
             }
             case '"':
             {
-                std::string val;
-                bool escape = false;
-                while(!fr.eof() && ((c = fr.getChar()) != '"' || escape))
+                size_t start = fr.pos;
+                fr.skipWhile([](char ch) { return ch != '"' && ch != '\\'; });
+                StrRef value = sourceValue(sf, start, fr.pos);
+                if(!fr.eof() && fr.peekChar() == '\\')
                 {
-                    if(c != '\\' || escape)
-                    {
-                        val += c;
-                        escape = false;
-                    }
-                    else
+                    std::string val = value;
+                    while(!fr.eof())
                     {
-                        escape = true;
+                        fr.readWhile([](char ch) { return ch != '"' && ch != '\\'; }, val);
+                        if(fr.eof() || fr.getChar() == '"')
+                        {
+                            break;
+                        }
+                        if(!fr.eof())
+                        {
+                            val += fr.getChar();
+                        }
                     }
+                    value = ownValue(sf, std::move(val));
+                }
+                else if(!fr.eof())
+                {
+                    fr.getChar();
                 }
-                pushToken(Token(ttStringValue, fr.file, line, col, val));
+                tokens.emplace_back(ttStringValue, fr.file, line, col, value);
                 break;
             }
             case 0x0a:
             {
-                pushToken(Token(ttEoln, fr.file, line, col));
+                tokens.emplace_back(ttEoln, fr.file, line, col);
                 break;
             }
             case '=':
             {
-                pushToken(Token(ttEqual, fr.file, line, col));
+                tokens.emplace_back(ttEqual, fr.file, line, col);
                 break;
             }
             case ':':
             {
-                pushToken(Token(ttColon, fr.file, line, col));
+                tokens.emplace_back(ttColon, fr.file, line, col);
                 break;
             }
             case ',':
             {
-                pushToken(Token(ttComma, fr.file, line, col));
+                tokens.emplace_back(ttComma, fr.file, line, col);
                 break;
             }
             case '<':
             {
-                pushToken(Token(ttAngleBracketOpen, fr.file, line, col));
+                tokens.emplace_back(ttAngleBracketOpen, fr.file, line, col);
                 break;
             }
             case '>':
             {
-                pushToken(Token(ttAngleBracketClose, fr.file, line, col));
+                tokens.emplace_back(ttAngleBracketClose, fr.file, line, col);
                 break;
             }
             default:
             {
                 if(isspace(c))
                 {
+                    fr.skipWhile([](char ch) { return ch != 0x0a && isspace(ch); });
                     continue;
                 }
                 if(!fileOrIdentChar(c))
                 {
                     throw ParsingException("Unexpected symbol at ", foundFile, line, col);
                 }
-                std::string val;
-                val = c;
+                size_t start = fr.pos - 1;
+                fr.skipWhile(fileOrIdentChar);
+                StrRef val(fr.data + start, fr.pos - start);
                 TokenType tt = ttIdent;
-                while((!fr.eof()) && fileOrIdentChar(c = fr.getChar()))
+                for(size_t i = 1; i < val.length(); i++)
                 {
-                    val += c;
-                    if(c == '.' || c == '/')
+                    if(val.ptr[i] == '.' || val.ptr[i] == '/')
                     {
                         tt = ttFileName;
+                        break;
                     }
                 }
-                if(!fr.eof() && !isspace(c)) // && c != '=' && c != ':' && c != ',' && c != '<' && c != '>'
+                c = 0;
+                if(!fr.eof())
                 {
-                    fr.putChar();
-                    //break;
-                    //throw ParsingException("Unexpected symbol at ", foundFile, line, fr.col - 1);
+                    c = fr.getChar();
+                    if(!fr.eof() && !isspace(c)) // && c != '=' && c != ':' && c != ',' && c != '<' && c != '>'
+                    {
+                        fr.putChar();
+                        //break;
+                        //throw ParsingException("Unexpected symbol at ", foundFile, line, fr.col - 1);
+                    }
                 }
                 if(tt == ttIdent)
                 {
                     tt = findKeyword(val);
                 }
 
-                pushToken(Token(tt, fr.file, line, col, val));
+                tokens.emplace_back(tt, fr.file, line, col, val);
                 if(c == 0x0a)
                 {
-                    pushToken(Token(ttEoln, fr.file, fr.line, fr.col));
+                    tokens.emplace_back(ttEoln, fr.file, fr.line, fr.col);
                 }
 //                if(c == '=')
 //                {
-//                    pushToken(Token(ttEqual, fr.file, line, col));
+//                    tokens.emplace_back(ttEqual, fr.file, line, col);
 //                }
 //                if(c == ':')
 //                {
-//                    pushToken(Token(ttColon, fr.file, line, col));
+//                    tokens.emplace_back(ttColon, fr.file, line, col);
 //                }
                 break;
             }
         }
     }
-    pushToken(Token(ttEof, fr.file, line, col));
+    tokens.emplace_back(ttEof, fr.file, line, col);
     if(blockComment)
     {
         throw ParsingException("Block comment wasn't closed at ", foundFile, bcline, bccol);
     }
-    if(recursive)
+}
+
+void Parser::parseFile(const char* fileName)
+{
+    ProfileScope profile("parse", fileName);
+    sources.clear();
+    TokensVector* tokens = lexFile(fileName);
+    if(!tokens)
     {
         return;
     }
-    recursive++;
+    prelexIncludes(*sources[files.back()]);
     enum CurrentContext {
         ccGlobal,
         ccMessage,
@@ -446,8 +632,17 @@ void Parser::parseFile(const char* fileName)
 
     std::string pkg;
 
-    for(auto it = tokens.begin(); it != tokens.end(); it++)
+    //included files are parsed in place, it of the include statement is kept until included file ends
+    std::vector<TokensVector::iterator> includeStack;
+    TokensVector* pendingInclude = nullptr;
+    bool done = false;
+    for(auto it = tokens->begin(); !done; it++)
     {
+        if(pendingInclude)
+        {
+            it = pendingInclude->begin();
+            pendingInclude = nullptr;
+        }
         //printf(">%s\n",TokenTypeToString(it->tt).c_str());
         switch(it->tt)
         {
@@ -469,9 +664,11 @@ void Parser::parseFile(const char* fileName)
                 pkgStack.push_back(pkg);
                 pkg = "";
                 std::string file = expect(it, (TokenTypeList(ttIdent), ttFileName)).value;
-                parsePos = it;
-                parsePos++;
-                parseFile(file.c_str());
+                pendingInclude = lexFile(file.c_str());
+                if(pendingInclude)
+                {
+                    includeStack.push_back(it);
+                }
                 break;
             }
             case ttType:
@@ -511,7 +708,7 @@ void Parser::parseFile(const char* fileName)
                 for(auto& p : properties)
                 {
                     auto& prop = p.second;
-                    if(prop.def == pdDefaultForType)
+                    if(prop->def == pdDefaultForType)
                     {
                         td.properties.emplace_back(prop);
                     }
@@ -519,22 +716,18 @@ void Parser::parseFile(const char* fileName)
 
                 while(expect(it, (TokenTypeList(ttIdent), ttEoln)).tt != ttEoln)
                 {
-                    Property p;
-                    p.name = it->value;
-                    auto pit = properties.find(p.name);
+                    auto pit = properties.find(it->value);
 
                     if(pit == properties.end())
                     {
                         throw PropertyNotFoundException(it->value, files[it->file], it->line, it->col);
                     }
 
-                    p = pit->second;
+                    PropertyUse p(pit->second);
                     expect(it, (TokenTypeList(ttIdent), ttEqual, ttEoln));
                     if(it->tt == ttEqual)
                     {
-                        PropertyField pf;
-                        fillPropertyField(it, p, pf);
-                        p.fields.push_back(pf);
+                        fillPropertyField(it, p);
                     }
                     else
                     {
@@ -542,7 +735,8 @@ void Parser::parseFile(const char* fileName)
                     }
                     td.properties.push_back(p);
                 }
-                types.emplace(td.typeName, td);
+                auto res = types.emplace(td.typeName, td);
+                typeIndex.emplace(td.typeName, &res.first->second);
                 break;
             }
             case ttProperty:
@@ -573,24 +767,20 @@ void Parser::parseFile(const char* fileName)
                 }
                 else //if(cc==ccMessage || cc==ccEnum)
                 {
-                    Property p;
-                    p.name = expect(it, ttIdent).value;
-                    auto pit = properties.find(p.name);
+                    auto pit = properties.find(expect(it, ttIdent).value);
 
                     if(pit == properties.end())
                     {
                         throw PropertyNotFoundException(it->value, files[it->file], it->line, it->col);
                     }
 
-                    p = pit->second;
+                    PropertyUse p(pit->second);
 
                     expect(it, (TokenTypeList(ttEqual), ttEoln));
                     if(it->tt == ttEqual)
                     {
-                        PropertyField pf;
                         //expect(it,(TokenTypeList(ttIntValue),ttStringValue,ttTrue,ttFalse,ttHexValue));
-                        fillPropertyField(it, p, pf);
-                        p.fields.push_back(pf);
+                        fillPropertyField(it, p);
                     }
                     if(cc == ccMessage)
                     {
@@ -616,7 +806,7 @@ void Parser::parseFile(const char* fileName)
                 curMsgTags.clear();
                 curMessage.name = expect(it, (ttIdent)).value;
                 curMessage.pkg = pkg;
-                if(messages.find(curMessage.name) != messages.end())
+                if(messageIndex.find(curMessage.name) != messageIndex.end())
                 {
                     throw DuplicateItemException("message", curMessage.name, files[it->file], it->line, it->col);
                 }
@@ -654,7 +844,7 @@ void Parser::parseFile(const char* fileName)
                 curMsgTags.clear();
                 curFieldSet.name = expect(it, ttIdent).value;
                 curFieldSet.pkg = pkg;
-                if(fsNames.find(curFieldSet.name) != fsNames.end())
+                if(fieldSetIndex.find(curFieldSet.name) != fieldSetIndex.end())
                 {
                     throw DuplicateItemException("fieldset", curFieldSet.name, files[it->file], it->line, it->col);
                 }
@@ -669,13 +859,13 @@ void Parser::parseFile(const char* fileName)
                 }
                 curEnum.clear();
                 curEnum.typeName = expect(it, (ttIdent)).value;
-                if(types.find(curEnum.typeName) == types.end())
+                if(typeIndex.find(curEnum.typeName) == typeIndex.end())
                 {
                     throw MessageOrTypeNotFoundException(it->value, files[it->file], it->line, it->col);
                 }
                 curEnum.name = expect(it, (ttIdent)).value;
                 curEnum.pkg = pkg;
-                if(enumMap.find(curEnum.name) != enumMap.end())
+                if(enumIndex.find(curEnum.name) != enumIndex.end())
                 {
                     throw DuplicateItemException("enum", curEnum.name, files[it->file], it->line, it->col);
                 }
@@ -692,7 +882,8 @@ void Parser::parseFile(const char* fileName)
                     {
                         throw BaseException("Message " + curMessage.name + " do not have version defined");
                     }
-                    messages.insert(MessageMap::value_type(curMessage.name, curMessage));
+                    auto res = messages.insert(MessageMap::value_type(curMessage.name, curMessage));
+                    messageIndex.emplace(curMessage.name, &res.first->second);
                 }
                 else if(cc == ccProtocol)
                 {
@@ -702,21 +893,30 @@ void Parser::parseFile(const char* fileName)
                 {
                     if(fsProp)
                     {
-                        curFieldSet.properties.insert(PropertyMap::value_type(curProperty.name, curProperty));
+                        curFieldSet.properties.insert(PropertyMap::value_type(curProperty.name,
+                                std::make_shared<const Property>(curProperty)));
                     }
                     else
                     {
-                        properties.insert(PropertyMap::value_type(curProperty.name, curProperty));
+                        properties.insert(PropertyMap::value_type(curProperty.name,
+                                std::make_shared<const Property>(curProperty)));
                     }
                 }
                 else if(cc == ccEnum)
                 {
-                    enumMap.insert(EnumMap::value_type(curEnum.name, curEnum));
+                    auto res = enumMap.insert(EnumMap::value_type(curEnum.name, curEnum));
+                    enumIndex.emplace(curEnum.name, &res.first->second);
                 }
                 else if(cc == ccFieldSet)
                 {
                     fieldsSets.push_back(curFieldSet);
-                    fieldsSets.back().finish();
+                    FieldSet& fs = fieldsSets.back();
+                    fs.finish();
+                    fieldSetIndex.emplace(fs.name, &fs);
+                    for(auto& field : fs.fields)
+                    {
+                        fieldSetByField.emplace(field.name, &fs);
+                    }
                 }
                 else
                 {
@@ -740,7 +940,8 @@ void Parser::parseFile(const char* fileName)
                     unexpected(it);
                 }
                 auto t = expect(it, (ttVersionValue));
-                const char* ptr = t.value.c_str();
+                std::string version = t.value;
+                const char* ptr = version.c_str();
                 char* end = nullptr;
                 int vmajor = strtol(ptr, &end, 10);
                 if(!end || ptr == end || *end == '\0')
@@ -771,11 +972,12 @@ void Parser::parseFile(const char* fileName)
                 if(cc == ccMessage || cc == ccFieldSet)
                 {
                     Field f;
-                    auto ftIt = types.find(it->value);
+                    const std::string typeName = it->value;
+                    auto ftIt = typeIndex.find(typeName);
                     bool fsField = false;
-                    if(ftIt != types.end())
+                    if(ftIt != typeIndex.end())
                     {
-                        const auto& tdef = ftIt->second;
+                        const auto& tdef = *ftIt->second;
                         f.ft.typeName = tdef.typeName;
                         f.ft.fk = FieldKind::Type;
                         if(!tdef.genericParamNames.empty())
@@ -814,48 +1016,46 @@ void Parser::parseFile(const char* fileName)
                             }
                         }
                     }
-                    else if(messages.find(it->value) != messages.end())
+                    else if(messageIndex.find(typeName) != messageIndex.end())
                     {
                         f.ft.fk = FieldKind::Nested;
-                        f.ft.typeName = it->value;
+                        f.ft.typeName = typeName;
                     }
-                    else if(enumMap.find(it->value) != enumMap.end())
+                    else if(enumIndex.find(typeName) != enumIndex.end())
                     {
                         f.ft.fk = FieldKind::Enum;
-                        f.ft.typeName = it->value;
+                        f.ft.typeName = typeName;
                     }
                     else
                     {
                         if(it->tt == ttFileName)
                         {
-                            std::string::size_type pos = it->value.find('.');
+                            std::string::size_type pos = typeName.find('.');
                             if(pos == std::string::npos)
                             {
                                 unexpected(it);
                             }
-                            std::string fsname = it->value.substr(0, pos);
-                            std::string fldname = it->value.substr(pos + 1);
+                            std::string fsname = typeName.substr(0, pos);
+                            std::string fldname = typeName.substr(pos + 1);
                             if(fldname.find('.') != std::string::npos)
                             {
                                 unexpected(it);
                             }
                             bool found = false;
-                            for(auto& fieldsSet : fieldsSets)
+                            auto fsIt = fieldSetIndex.find(fsname);
+                            if(fsIt != fieldSetIndex.end())
                             {
-                                if(fieldsSet.name == fsname)
+                                FieldSet& fieldsSet = *fsIt->second;
+                                auto fld = fieldsSet.fieldsMap.find(fldname);
+                                if(fld != fieldsSet.fieldsMap.end())
+                                {
+                                    fieldsSet.used = true;
+                                    f = *fld->second;
+                                    found = true;
+                                }
+                                else
                                 {
-                                    auto fld = fieldsSet.fieldsMap.find(fldname);
-                                    if(fld != fieldsSet.fieldsMap.end())
-                                    {
-                                        fieldsSet.used = true;
-                                        f = *fld->second;
-                                        found = true;
-                                        break;
-                                    }
-                                    else
-                                    {
-                                        throw NotFoundException("field", it->value, files[it->file], it->line, it->col);
-                                    }
+                                    throw NotFoundException("field", it->value, files[it->file], it->line, it->col);
                                 }
                             }
                             if(!found)
@@ -866,16 +1066,13 @@ void Parser::parseFile(const char* fileName)
                         else
                         {
                             bool found = false;
-                            for(auto& fieldsSet : fieldsSets)
+                            auto fsIt = fieldSetByField.find(typeName);
+                            if(fsIt != fieldSetByField.end())
                             {
-                                auto fld = fieldsSet.fieldsMap.find(it->value);
-                                if(fld != fieldsSet.fieldsMap.end())
-                                {
-                                    fieldsSet.used = true;
-                                    f = *fld->second;
-                                    found = true;
-                                    break;
-                                }
+                                FieldSet& fieldsSet = *fsIt->second;
+                                fieldsSet.used = true;
+                                f = *fieldsSet.fieldsMap.find(typeName)->second;
+                                found = true;
                             }
                             if(!found)
                             {
@@ -941,27 +1138,11 @@ void Parser::parseFile(const char* fileName)
                                     throw PropertyNotFoundException(it->value, files[it->file], it->line, it->col);
                                 }
                             }
-                            Property p = pit->second;
+                            PropertyUse p(pit->second);
                             expect(it, (TokenTypeList(ttIdent), ttEqual, ttEoln));
                             if(it->tt == ttEqual)
                             {
-                                PropertyField pf;
-                                pf.name = p.name;
-                                pf.pt = p.pt;
-                                if(p.pt == ptBool)
-                                {
-                                    pf.boolValue = expect(it, (TokenTypeList(ttTrue), ttFalse)).asBool();
-                                }
-                                else if(p.pt == ptInt)
-                                {
-                                    pf.intValue = expect(it, (TokenTypeList(ttIntValue), ttHexValue)).asInt();
-                                }
-                                else//ptString
-                                {
-                                    expect(it, ttStringValue);
-                                    pf.strValue = it->value;
-                                }
-                                p.fields.push_back(pf);
+                                fillPropertyField(it, p);
                             }
                             f.properties.push_back(p);
                         }
@@ -987,36 +1168,18 @@ void Parser::parseFile(const char* fileName)
                         expect(it, (TokenTypeList(ttEoln), ttIdent));
                         while(it->tt == ttIdent)
                         {
-                            Property p;
-                            p.name = it->value;
-                            auto pit = properties.find(p.name);
+                            auto pit = properties.find(it->value);
 
                             if(pit == properties.end())
                             {
                                 throw PropertyNotFoundException(it->value, files[it->file], it->line, it->col);
                             }
 
-                            p = pit->second;
+                            PropertyUse p(pit->second);
                             expect(it, (TokenTypeList(ttEqual), ttIdent, ttEoln));
                             if(it->tt == ttEqual)
                             {
-                                PropertyField pf;
-                                pf.name = p.name;
-                                pf.pt = p.pt;
-                                if(p.pt == ptBool)
-                                {
-                                    pf.boolValue = expect(it, (TokenTypeList(ttTrue), ttFalse)).asBool();
-                                }
-                                else if(p.pt == ptInt)
-                                {
-                                    pf.intValue = expect(it, (TokenTypeList(ttIntValue), ttHexValue)).asInt();
-                                }
-                                else//ptString
-                                {
-                                    expect(it, ttStringValue);
-                                    pf.strValue = it->value;
-                                }
-                                p.fields.push_back(pf);
+                                fillPropertyField(it, p);
                             }
                             mr.props.push_back(p);
                         }
@@ -1153,6 +1316,15 @@ void Parser::parseFile(const char* fileName)
                     pkg = pkgStack.back();
                     pkgStack.pop_back();
                 }
+                if(includeStack.empty())
+                {
+                    done = true;
+                }
+                else
+                {
+                    it = includeStack.back();
+                    includeStack.pop_back();
+                }
                 break;
             }
             case ttEoln:
@@ -1175,21 +1347,21 @@ void Parser::parseFile(const char* fileName)
     }
     for(auto& prop : properties)
     {
-        if(prop.second.def == pdNotDefault)
+        if(prop.second->def == pdNotDefault)
         {
             continue;
         }
         for(auto& message : messages)
         {
-            if(prop.second.def == pdDefaultForMessage)
+            if(prop.second->def == pdDefaultForMessage)
             {
-                message.second.properties.push_front(prop.second);
+                message.second.properties.emplace(message.second.properties.begin(), prop.second);
             }
-            else if(prop.second.def == pdDefaultForField)
+            else if(prop.second->def == pdDefaultForField)
             {
                 for(auto& field : message.second.fields)
                 {
-                    field.properties.push_front(prop.second);
+                    field.properties.emplace(field.properties.begin(), prop.second);
                 }
             }
 //            else if(prop.second.def == pdDefaultForType)
@@ -1203,22 +1375,22 @@ void Parser::parseFile(const char* fileName)
 //                }
 //            }
         }
-        if(prop.second.def == pdDefaultForEnum)
+        if(prop.second->def == pdDefaultForEnum)
         {
             for(auto& eit : enumMap)
             {
-                eit.second.properties.push_front(prop.second);
+                eit.second.properties.emplace(eit.second.properties.begin(), prop.second);
             }
         }
-        if(prop.second.def == pdDefaultForField || prop.second.def == pdDefaultForType)
+        if(prop.second->def == pdDefaultForField || prop.second->def == pdDefaultForType)
         {
             for(auto& fieldsSet : fieldsSets)
             {
                 for(auto& field : fieldsSet.fields)
                 {
-                    if(prop.second.def == pdDefaultForField)
+                    if(prop.second->def == pdDefaultForField)
                     {
-                        field.properties.push_front(prop.second);
+                        field.properties.emplace(field.properties.begin(), prop.second);
                     }
 //                    else
 //                    {
@@ -1231,11 +1403,14 @@ void Parser::parseFile(const char* fileName)
             }
         }
     }
+    //message fields grouped by the fieldset they came from, filled on first use
+    std::unordered_map<std::string, std::vector<Field*>> fsMessageFields;
+    bool fsMessageFieldsReady = false;
     for(auto& fieldsSet : fieldsSets)
     {
         for(auto pit = fieldsSet.properties.begin(); pit != fieldsSet.properties.end(); ++pit)
         {
-            if(pit->second.def != pdDefaultForField)
+            if(pit->second->def != pdDefaultForField)
             {
                 continue;
             }
@@ -1244,42 +1419,52 @@ void Parser::parseFile(const char* fileName)
                 bool found = false;
                 for(auto& prop : field.properties)
                 {
-                    if(prop.name == pit->first)
+                    if(prop.name() == pit->first)
                     {
-                        prop = pit->second;
+                        prop = PropertyUse(pit->second);
                         found = true;
                         break;
                     }
                 }
                 if(!found)
                 {
-                    field.properties.push_front(pit->second);
+                    field.properties.emplace(field.properties.begin(), pit->second);
                 }
             }
-            for(auto& message : messages)
+            if(!fsMessageFieldsReady)
             {
-                for(auto& field : message.second.fields)
+                fsMessageFieldsReady = true;
+                for(auto& message : messages)
                 {
-                    if(field.fsname == fieldsSet.name)
+                    for(auto& field : message.second.fields)
                     {
-                        field.properties.push_back(pit->second);
+                        if(!field.fsname.empty())
+                        {
+                            fsMessageFields[field.fsname].push_back(&field);
+                        }
                     }
                 }
             }
+            for(auto field : fsMessageFields[fieldsSet.name])
+            {
+                field->properties.emplace_back(pit->second);
+            }
         }
     }
-    recursive--;
+    sources.clear();
 }
 
-void Parser::fillPropertyField(TokensList::iterator& it, Property& p, PropertyField& pf)
+void Parser::fillPropertyField(TokensVector::iterator& it, PropertyUse& p)
 {
-    pf.name = p.name;
-    pf.pt = p.pt;
-    if(p.pt == ptBool)
+    PropertyField& pf = p.value;
+    p.haveValue = true;
+    pf.name = p.def->name;
+    pf.pt = p.def->pt;
+    if(pf.pt == ptBool)
     {
         pf.boolValue = expect(it, (TokenTypeList(ttTrue), ttFalse)).asBool();
     }
-    else if(p.pt == ptInt)
+    else if(pf.pt == ptInt)
     {
         pf.intValue = expect(it, (TokenTypeList(ttIntValue), ttHexValue)).asInt();
     }
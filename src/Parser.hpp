@@ -8,9 +8,15 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <exception>
 
 #include "Exceptions.hpp"
 #include "FileReader.hpp"
+#include "Utility.hpp"
 
 namespace protogen {
 
@@ -66,8 +72,43 @@ struct Property {
     }
 };
 
-typedef std::list<Property> PropertyList;
-typedef std::map<std::string, Property> PropertyMap;
+//property definitions are immutable once parsed and shared by all their uses
+typedef std::shared_ptr<const Property> PropertyPtr;
+
+//use of a property in a type, message, field, enum or protocol
+struct PropertyUse {
+    PropertyUse() = default;
+
+    explicit PropertyUse(PropertyPtr argDef) : def(std::move(argDef))
+    {
+    }
+
+    PropertyPtr def;
+    //value assigned at the place of use, follows fields of definition
+    bool haveValue = false;
+    PropertyField value;
+
+    const std::string& name() const
+    {
+        return def->name;
+    }
+
+    template<class F>
+    void forEachField(F f) const
+    {
+        for(const auto& pf : def->fields)
+        {
+            f(pf);
+        }
+        if(haveValue)
+        {
+            f(value);
+        }
+    }
+};
+
+typedef std::vector<PropertyUse> PropertyList;
+typedef std::map<std::string, PropertyPtr> PropertyMap;
 
 enum class FieldKind {
     Type,
@@ -212,21 +253,27 @@ class Parser {
 public:
     Parser()
     {
-        parsePos = tokens.end();
-        recursive = 0;
         requireVersion = false;
     }
 
     void parseFile(const char* fileName);
 
+    /*
+     * Binary cache of the parsed model, see ParserCache.cpp.
+     * loadCache returns false if the cache is missing, was written for
+     * other sources or options, or any of parsed files has changed.
+     */
+    bool loadCache(const std::string& cacheFile, const StrVector& sources);
+    bool saveCache(const std::string& cacheFile, const StrVector& sources) const;
+
     const TypeDef& getType(const std::string& name)const
     {
-        auto it = types.find(name);
-        if(it == types.end())
+        auto it = typeIndex.find(name);
+        if(it == typeIndex.end())
         {
             throw MessageOrTypeNotFoundException(name, "", 0, 0);
         }
-        return it->second;
+        return *it->second;
     }
 
     const ProtocolsMap& getProtocols() const
@@ -246,24 +293,22 @@ public:
 
     const FieldSet& getFieldset(const std::string& name)
     {
-        for(auto& fieldsSet : fieldsSets)
+        auto it = fieldSetIndex.find(name);
+        if(it == fieldSetIndex.end())
         {
-            if(fieldsSet.name == name)
-            {
-                return fieldsSet;
-            }
+            throw FieldSetNotFoundException(name, "", 0, 0);
         }
-        throw FieldSetNotFoundException(name, "", 0, 0);
+        return *it->second;
     }
 
     const Enum& getEnum(const std::string& enumName) const
     {
-        auto it = enumMap.find(enumName);
-        if(it == enumMap.end())
+        auto it = enumIndex.find(enumName);
+        if(it == enumIndex.end())
         {
             throw TypeNotFoundException(enumName, "", 0, 0);
         }
-        return it->second;
+        return *it->second;
     }
 
     const Protocol& getProtocol(const std::string& protoName) const
@@ -278,12 +323,12 @@ public:
 
     const Message& getMessage(const std::string& name) const
     {
-        auto it = messages.find(name);
-        if(it == messages.end())
+        auto it = messageIndex.find(name);
+        if(it == messageIndex.end())
         {
             throw MessageNotFoundException(name, "", 0, 0);
         }
-        return it->second;
+        return *it->second;
     }
 
     void addSearchPath(const std::string& path)
@@ -301,6 +346,12 @@ public:
         requireVersion = value;
     }
 
+    //number of threads used to lex included files
+    void setJobs(size_t value)
+    {
+        jobs = value;
+    }
+
     typedef std::map<std::string, Message> MessageMap;
 
     const MessageMap& getMessages() const
@@ -314,13 +365,20 @@ public:
     }
 
 protected:
-    std::set<std::string> fsNames;
     FieldSetsList fieldsSets;
     MessageMap messages;
     ProtocolsMap protocols;
     FieldTypeMap types;
     PropertyMap properties;
     EnumMap enumMap;
+
+    //hash indexes over the ordered containers above, used for lookups by name
+    std::unordered_map<std::string, FieldSet*> fieldSetIndex;
+    //first fieldset that defines a field with given name
+    std::unordered_map<std::string, FieldSet*> fieldSetByField;
+    std::unordered_map<std::string, Message*> messageIndex;
+    std::unordered_map<std::string, Enum*> enumIndex;
+    std::unordered_map<std::string, TypeDef*> typeIndex;
     bool requireVersion;
 
     struct Token {
@@ -328,8 +386,8 @@ protected:
         {
         }
 
-        Token(TokenType argTt, int argFile, int argLine, int argCol, std::string argValue = "") :
-                tt(argTt), file(argFile), line(argLine), col(argCol), value(std::move(argValue))
+        Token(TokenType argTt, int argFile, int argLine, int argCol, StrRef argValue = StrRef()) :
+                tt(argTt), file(argFile), line(argLine), col(argCol), value(argValue)
         {
         }
 
@@ -337,16 +395,17 @@ protected:
         int file;
         int line;
         int col;
-        std::string value;
+        StrRef value;
 
         int asInt() const
         {
+            std::string str = value;
             if(tt == ttIntValue)
             {
-                return atoi(value.c_str());
+                return atoi(str.c_str());
             }
             int rv;
-            sscanf(value.c_str(), "0x%x", &rv);
+            sscanf(str.c_str(), "0x%x", &rv);
             return rv;
         }
 
@@ -357,19 +416,39 @@ protected:
     };
 
     StrVector files;
-    typedef std::list<Token> TokensList;
-    TokensList tokens;
-    TokensList::iterator parsePos;
-    int recursive;
+    //identity of already parsed files, see fileKey
+    std::unordered_set<std::string> fileKeys;
+    typedef std::vector<Token> TokensVector;
+
+    struct SourceFile {
+        explicit SourceFile(const std::string& argFileName) : fileName(argFileName)
+        {
+        }
+
+        std::string fileName;
+        FileReader fr;
+        TokensVector tokens;
+        //values that differ from the source text (escaped strings, CRLF)
+        std::deque<std::string> strings;
+        //lexing error, rethrown when parser reaches include of this file
+        std::exception_ptr error;
+    };
+    //token values point into mapped sources, so they are kept until parseFile is done
+    std::unordered_map<std::string, std::unique_ptr<SourceFile>> sources;
 
     StrVector searchPath;
     bool searchInCurDir = true;
+    size_t jobs = 1;
 
-    void pushToken(const Token& t)
-    {
-        parsePos = tokens.insert(parsePos, t);
-        parsePos++;
-    }
+    static std::string fileKey(const std::string& path);
+    std::string cacheKey(const StrVector& sources) const;
+
+    TokensVector* lexFile(const char* fileName);
+    static void lexSource(SourceFile& sf);
+    StrVector findIncludes(const SourceFile& sf) const;
+    void prelexIncludes(const SourceFile& root);
+    static StrRef sourceValue(SourceFile& sf, size_t start, size_t end);
+    static StrRef ownValue(SourceFile& sf, std::string value);
 
     struct TokenTypeList {
         TokenTypeList(TokenType argTt) : tt(argTt), prev(0)
@@ -387,15 +466,15 @@ protected:
         }
     };
 
-    const Token& expect(TokensList::iterator& it, const TokenTypeList& ttl);
-    bool advanceIf(TokensList::iterator& it, TokenType tt);
+    const Token& expect(TokensVector::iterator& it, const TokenTypeList& ttl);
+    bool advanceIf(TokensVector::iterator& it, TokenType tt);
 
-    void unexpected(TokensList::iterator it)
+    void unexpected(TokensVector::iterator it)
     {
         throw ParsingException("Unexpected '" + TokenTypeToString(it->tt) + "' at", files[it->file], it->line, it->col);
     }
 
-    void fillPropertyField(TokensList::iterator& it, Property& p, PropertyField& pf);
+    void fillPropertyField(TokensVector::iterator& it, PropertyUse& p);
 
 };
 
@@ -0,0 +1,385 @@
+#include "Parser.hpp"
+#include "OutputSink.hpp"
+#include "ModelWriter.hpp"
+#include <stdint.h>
+#include <string.h>
+
+namespace protogen {
+
+namespace {
+
+const char cacheMagic[] = "protogen schema cache 2";
+
+bool hashFile(const std::string& fileName, size_t& size, uint64_t& hash)
+{
+    try
+    {
+        FileReader fr;
+        fr.Open(fileName);
+        size = fr.fileSize;
+        hash = hashData(fr.data, fr.fileSize);
+        return true;
+    }
+    catch(std::exception&)
+    {
+        return false;
+    }
+}
+
+class CacheReader {
+public:
+    CacheReader(const char* argPtr, size_t size) : ptr(argPtr), end(argPtr + size)
+    {
+    }
+
+    const char* ptr;
+    const char* end;
+    std::vector<PropertyPtr> props;
+
+    void need(size_t size)
+    {
+        if(static_cast<size_t>(end - ptr) < size)
+        {
+            throw std::runtime_error("schema cache is truncated");
+        }
+    }
+
+    void read(uint32_t& value)
+    {
+        need(sizeof(value));
+        memcpy(&value, ptr, sizeof(value));
+        ptr += sizeof(value);
+    }
+
+    void read(uint64_t& value)
+    {
+        need(sizeof(value));
+        memcpy(&value, ptr, sizeof(value));
+        ptr += sizeof(value);
+    }
+
+    void read(int& value)
+    {
+        uint32_t v;
+        read(v);
+        value = static_cast<int>(v);
+    }
+
+    void read(bool& value)
+    {
+        uint32_t v;
+        read(v);
+        value = v != 0;
+    }
+
+    template<class E>
+    void readEnum(E& value)
+    {
+        int v;
+        read(v);
+        value = static_cast<E>(v);
+    }
+
+    void read(std::string& value)
+    {
+        uint32_t len;
+        read(len);
+        need(len);
+        value.assign(ptr, len);
+        ptr += len;
+    }
+
+    void read(PropertyField& pf)
+    {
+        readEnum(pf.pt);
+        read(pf.name);
+        read(pf.boolValue);
+        read(pf.intValue);
+        read(pf.strValue);
+    }
+
+    void read(PropertyPtr& p)
+    {
+        uint32_t idx;
+        read(idx);
+        if(idx < props.size())
+        {
+            p = props[idx];
+            return;
+        }
+        if(idx != props.size())
+        {
+            throw std::runtime_error("invalid property index in schema cache");
+        }
+        std::shared_ptr<Property> def = std::make_shared<Property>();
+        read(def->name);
+        readEnum(def->pt);
+        readEnum(def->def);
+        read(def->fields);
+        props.push_back(def);
+        p = def;
+    }
+
+    void read(PropertyUse& pu)
+    {
+        read(pu.def);
+        read(pu.haveValue);
+        if(pu.haveValue)
+        {
+            read(pu.value);
+        }
+    }
+
+    void read(TypeDef& td)
+    {
+        read(td.typeName);
+        readEnum(td.tk);
+        read(td.properties);
+        read(td.genericParamNames);
+    }
+
+    void read(Field& f)
+    {
+        read(f.ft.typeName);
+        readEnum(f.ft.fk);
+        read(f.ft.genericParamsValues);
+        read(f.name);
+        read(f.fsname);
+        read(f.tag);
+        read(f.properties);
+    }
+
+    void read(FieldSet& fs)
+    {
+        read(fs.name);
+        read(fs.pkg);
+        read(fs.fields);
+        read(fs.properties);
+        read(fs.used);
+    }
+
+    void read(Message& msg)
+    {
+        int version;
+        read(msg.name);
+        read(msg.pkg);
+        read(msg.parent);
+        read(version);
+        msg.majorVersion = static_cast<uint16_t>(version);
+        read(version);
+        msg.minorVersion = static_cast<uint16_t>(version);
+        read(msg.fields);
+        read(msg.properties);
+        read(msg.tag);
+        read(msg.haveTag);
+    }
+
+    void read(Protocol::MessageRecord& mr)
+    {
+        read(mr.msgName);
+        read(mr.props);
+    }
+
+    void read(Protocol& proto)
+    {
+        read(proto.name);
+        read(proto.pkg);
+        read(proto.messages);
+    }
+
+    void read(Enum::EnumValue& ev)
+    {
+        read(ev.name);
+        read(ev.strVal);
+        read(ev.intVal);
+    }
+
+    void read(Enum& e)
+    {
+        read(e.name);
+        read(e.typeName);
+        read(e.pkg);
+        read(e.properties);
+        readEnum(e.vt);
+        read(e.values);
+    }
+
+    template<class T>
+    void read(std::vector<T>& items)
+    {
+        uint32_t count;
+        read(count);
+        items.clear();
+        for(uint32_t i = 0; i < count; i++)
+        {
+            items.emplace_back();
+            read(items.back());
+        }
+    }
+
+    template<class T>
+    void read(std::list<T>& items)
+    {
+        uint32_t count;
+        read(count);
+        items.clear();
+        for(uint32_t i = 0; i < count; i++)
+        {
+            items.emplace_back();
+            read(items.back());
+        }
+    }
+
+    template<class T>
+    void read(std::map<std::string, T>& items)
+    {
+        uint32_t count;
+        read(count);
+        items.clear();
+        for(uint32_t i = 0; i < count; i++)
+        {
+            std::string key;
+            read(key);
+            read(items[key]);
+        }
+    }
+};
+
+}
+
+std::string Parser::cacheKey(const StrVector& sources) const
+{
+    std::string rv = cacheMagic;
+    for(auto& source : sources)
+    {
+        rv += "\nsource=" + source;
+    }
+    for(auto& path : searchPath)
+    {
+        rv += "\nsearch.path=" + path;
+    }
+    rv += searchInCurDir ? "\ncurdir" : "";
+    rv += requireVersion ? "\nrequireVersion" : "";
+    return rv;
+}
+
+bool Parser::saveCache(const std::string& cacheFile, const StrVector& sources) const
+{
+    ModelWriter cw;
+    cw.write(cacheKey(sources));
+    cw.write(static_cast<uint32_t>(files.size()));
+    for(auto& file : files)
+    {
+        size_t size;
+        uint64_t hash;
+        if(!hashFile(file, size, hash))
+        {
+            return false;
+        }
+        cw.write(file);
+        cw.write(static_cast<uint64_t>(size));
+        cw.write(hash);
+    }
+    cw.write(messages);
+    cw.write(protocols);
+    cw.write(types);
+    cw.write(properties);
+    cw.write(enumMap);
+    cw.write(fieldsSets);
+
+    FileOutputSink out(cacheFile, true);
+    out.write(cw.buf.data(), cw.buf.size());
+    return out.commit();
+}
+
+bool Parser::loadCache(const std::string& cacheFile, const StrVector& sources)
+{
+    struct stat st = {};
+    if(::stat(cacheFile.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    try
+    {
+        FileReader fr;
+        fr.Open(cacheFile);
+        CacheReader cr(fr.data, fr.fileSize);
+        std::string key;
+        cr.read(key);
+        if(key != cacheKey(sources))
+        {
+            return false;
+        }
+        uint32_t count;
+        cr.read(count);
+        StrVector cachedFiles;
+        for(uint32_t i = 0; i < count; i++)
+        {
+            std::string file;
+            uint64_t cachedSize, cachedHash;
+            cr.read(file);
+            cr.read(cachedSize);
+            cr.read(cachedHash);
+            size_t size;
+            uint64_t hash;
+            if(!hashFile(file, size, hash) || size != cachedSize || hash != cachedHash)
+            {
+                return false;
+            }
+            cachedFiles.push_back(file);
+        }
+        MessageMap cachedMessages;
+        ProtocolsMap cachedProtocols;
+        FieldTypeMap cachedTypes;
+        PropertyMap cachedProperties;
+        EnumMap cachedEnums;
+        FieldSetsList cachedFieldSets;
+        cr.read(cachedMessages);
+        cr.read(cachedProtocols);
+        cr.read(cachedTypes);
+        cr.read(cachedProperties);
+        cr.read(cachedEnums);
+        cr.read(cachedFieldSets);
+
+        files.swap(cachedFiles);
+        messages.swap(cachedMessages);
+        protocols.swap(cachedProtocols);
+        types.swap(cachedTypes);
+        properties.swap(cachedProperties);
+        enumMap.swap(cachedEnums);
+        fieldsSets.swap(cachedFieldSets);
+    }
+    catch(std::exception&)
+    {
+        return false;
+    }
+
+    for(auto& file : files)
+    {
+        fileKeys.insert(fileKey(file));
+    }
+    for(auto& it : messages)
+    {
+        messageIndex.emplace(it.first, &it.second);
+    }
+    for(auto& it : types)
+    {
+        typeIndex.emplace(it.first, &it.second);
+    }
+    for(auto& it : enumMap)
+    {
+        enumIndex.emplace(it.first, &it.second);
+    }
+    for(auto& fs : fieldsSets)
+    {
+        fs.finish();
+        fieldSetIndex.emplace(fs.name, &fs);
+        for(auto& field : fs.fields)
+        {
+            fieldSetByField.emplace(field.name, &fs);
+        }
+    }
+    return true;
+}
+
+} // namespace protogen
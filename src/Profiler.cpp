@@ -0,0 +1,265 @@
+#include "Profiler.hpp"
+#include "OutputSink.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <new>
+#include <stdlib.h>
+#include <vector>
+
+namespace {
+
+thread_local uint64_t threadAllocs = 0;
+
+}
+
+//allocations are counted per thread, so scope can take difference
+void* operator new(size_t size)
+{
+    threadAllocs++;
+    void* ptr = malloc(size ? size : 1);
+    if(!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    threadAllocs++;
+    return malloc(size ? size : 1);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    free(ptr);
+}
+
+namespace protogen {
+
+namespace {
+
+struct ProfileEvent {
+    const char* category;
+    std::string name;
+    uint64_t start;
+    uint64_t duration;
+    uint64_t allocs;
+    int tid;
+};
+
+std::mutex eventsMtx;
+std::vector<ProfileEvent> events;
+std::map<std::pair<std::string, int>, TemplateLineStat> templateLines;
+std::atomic<int> threadCounter(0);
+thread_local int threadId = -1;
+
+const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+struct EventStat {
+    size_t count = 0;
+    uint64_t duration = 0;
+    uint64_t allocs = 0;
+
+    void add(const ProfileEvent& ev)
+    {
+        count++;
+        duration += ev.duration;
+        allocs += ev.allocs;
+    }
+};
+
+void appendStatLine(std::string& rv, const std::string& title, const EventStat& st)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%10.3f %8zu %10.3f %10llu  ", st.duration / 1e6, st.count,
+             st.duration / 1e6 / st.count, static_cast<unsigned long long>(st.allocs));
+    rv += buf;
+    rv += title;
+    rv += '\n';
+}
+
+void appendJsonString(std::string& rv, const std::string& str)
+{
+    rv += '"';
+    for(char c : str)
+    {
+        if(c == '"' || c == '\\')
+        {
+            rv += '\\';
+            rv += c;
+        }
+        else if(static_cast<unsigned char>(c) < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            rv += buf;
+        }
+        else
+        {
+            rv += c;
+        }
+    }
+    rv += '"';
+}
+
+}
+
+bool Profiler::enabledFlag = false;
+bool Profiler::templatesFlag = false;
+
+uint64_t Profiler::now()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - startTime).count());
+}
+
+uint64_t Profiler::allocCount()
+{
+    return threadAllocs;
+}
+
+void Profiler::record(const char* category, std::string name, uint64_t start, uint64_t duration, uint64_t allocs)
+{
+    if(threadId == -1)
+    {
+        threadId = threadCounter++;
+    }
+    std::lock_guard<std::mutex> guard(eventsMtx);
+    events.push_back(ProfileEvent{category, std::move(name), start, duration, allocs, threadId});
+}
+
+void Profiler::recordTemplateLines(const std::vector<TemplateLineStat>& lines)
+{
+    std::lock_guard<std::mutex> guard(eventsMtx);
+    for(auto& ls : lines)
+    {
+        TemplateLineStat& st = templateLines[std::make_pair(ls.file, ls.line)];
+        st.file = ls.file;
+        st.line = ls.line;
+        st.add(ls);
+    }
+}
+
+std::string Profiler::report()
+{
+    const size_t maxItems = 30;
+    std::map<std::string, EventStat> byCategory;
+    std::map<std::pair<std::string, std::string>, EventStat> byName;
+    std::vector<TemplateLineStat> lines;
+    {
+        std::lock_guard<std::mutex> guard(eventsMtx);
+        for(auto& it : templateLines)
+        {
+            lines.push_back(it.second);
+        }
+        for(auto& ev : events)
+        {
+            byCategory[ev.category].add(ev);
+            byName[std::make_pair(ev.category, ev.name)].add(ev);
+        }
+    }
+    typedef std::pair<std::string, EventStat> StatItem;
+    auto byDuration = [](const StatItem& a, const StatItem& b)
+    {
+        return a.second.duration > b.second.duration;
+    };
+    std::vector<StatItem> cats(byCategory.begin(), byCategory.end());
+    std::sort(cats.begin(), cats.end(), byDuration);
+    std::vector<StatItem> items;
+    for(auto& it : byName)
+    {
+        //one item per generated entity or file, these are only in phase summary and trace
+        if(it.first.first == "init" || it.first.first == "write")
+        {
+            continue;
+        }
+        items.emplace_back(it.first.first + " " + it.first.second, it.second);
+    }
+    std::sort(items.begin(), items.end(), byDuration);
+
+    //phases are nested (load includes parse), so totals of different phases overlap
+    std::string rv = "Profile by phase:\n";
+    rv += "  total ms    count     avg ms     allocs  phase\n";
+    for(auto& it : cats)
+    {
+        appendStatLine(rv, it.first, it.second);
+    }
+    rv += "Profile by item:\n";
+    rv += "  total ms    count     avg ms     allocs  phase item\n";
+    for(size_t i = 0; i < items.size() && i < maxItems; i++)
+    {
+        appendStatLine(rv, items[i].first, items[i].second);
+    }
+    if(items.size() > maxItems)
+    {
+        rv += "... " + std::to_string(items.size() - maxItems) + " more items\n";
+    }
+    if(lines.empty())
+    {
+        return rv;
+    }
+    //time of op lasts until next op starts, so output of text and vars is included
+    std::sort(lines.begin(), lines.end(), [](const TemplateLineStat& a, const TemplateLineStat& b)
+    {
+        return a.time > b.time;
+    });
+    rv += "Profile by template line:\n";
+    rv += "  total ms      execs    loop it    var get   sel miss    pack ms  line\n";
+    for(size_t i = 0; i < lines.size() && i < maxItems; i++)
+    {
+        const TemplateLineStat& ls = lines[i];
+        char buf[128];
+        snprintf(buf, sizeof(buf), "%10.3f %10llu %10llu %10llu %10llu %10.3f  ", ls.time / 1e6,
+                 static_cast<unsigned long long>(ls.execs), static_cast<unsigned long long>(ls.loopIterations),
+                 static_cast<unsigned long long>(ls.varLookups), static_cast<unsigned long long>(ls.selectMisses),
+                 ls.packTime / 1e6);
+        rv += buf;
+        rv += ls.file + ":" + std::to_string(ls.line) + "\n";
+    }
+    if(lines.size() > maxItems)
+    {
+        rv += "... " + std::to_string(lines.size() - maxItems) + " more lines\n";
+    }
+    return rv;
+}
+
+bool Profiler::writeTrace(const std::string& fileName)
+{
+    std::string rv = "{\"traceEvents\":[\n";
+    {
+        std::lock_guard<std::mutex> guard(eventsMtx);
+        for(size_t i = 0; i < events.size(); i++)
+        {
+            const ProfileEvent& ev = events[i];
+            char buf[160];
+            rv += "{\"name\":";
+            appendJsonString(rv, ev.name);
+            rv += ",\"cat\":";
+            appendJsonString(rv, ev.category);
+            snprintf(buf, sizeof(buf), ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"allocs\":%llu}}",
+                     ev.start / 1e3, ev.duration / 1e3, ev.tid, static_cast<unsigned long long>(ev.allocs));
+            rv += buf;
+            rv += i + 1 < events.size() ? ",\n" : "\n";
+        }
+    }
+    rv += "]}\n";
+    FileOutputSink out(fileName, false);
+    out.write(rv.data(), rv.size());
+    return out.commit();
+}
+
+} // namespace protogen
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace protogen {
+
+//cost of template ops from one source line
+struct TemplateLineStat {
+    std::string file;
+    int line = 0;
+    uint64_t execs = 0;
+    uint64_t time = 0;
+    uint64_t loopIterations = 0;
+    uint64_t varLookups = 0;
+    uint64_t selectMisses = 0;
+    uint64_t packTime = 0;
+
+    void add(const TemplateLineStat& other)
+    {
+        execs += other.execs;
+        time += other.time;
+        loopIterations += other.loopIterations;
+        varLookups += other.varLookups;
+        selectMisses += other.selectMisses;
+        packTime += other.packTime;
+    }
+};
+
+/*
+ * Collects timing and allocation count of generator phases.
+ * Disabled by default, scopes cost only a check of a flag then.
+ */
+class Profiler {
+public:
+    static void enable()
+    {
+        enabledFlag = true;
+    }
+
+    static bool enabled()
+    {
+        return enabledFlag;
+    }
+
+    //time every executed template op, adds noticeable overhead to rendering
+    static void enableTemplates()
+    {
+        enabledFlag = true;
+        templatesFlag = true;
+    }
+
+    static bool templatesEnabled()
+    {
+        return templatesFlag;
+    }
+
+    //monotonic time in nanoseconds
+    static uint64_t now();
+
+    //number of allocations made by current thread so far
+    static uint64_t allocCount();
+
+    static void record(const char* category, std::string name, uint64_t start, uint64_t duration, uint64_t allocs);
+
+    static void recordTemplateLines(const std::vector<TemplateLineStat>& lines);
+
+    //summary of recorded events sorted by total time
+    static std::string report();
+
+    //write recorded events in chrome trace_event format (chrome://tracing, perfetto)
+    static bool writeTrace(const std::string& fileName);
+
+protected:
+    static bool enabledFlag;
+    static bool templatesFlag;
+};
+
+class ProfileScope {
+public:
+    ProfileScope(const char* argCategory, const std::string& argName) : category(argCategory)
+    {
+        if(Profiler::enabled())
+        {
+            active = true;
+            name = argName;
+            allocs = Profiler::allocCount();
+            start = Profiler::now();
+        }
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+    ~ProfileScope()
+    {
+        if(active)
+        {
+            uint64_t duration = Profiler::now() - start;
+            Profiler::record(category, std::move(name), start, duration, Profiler::allocCount() - allocs);
+        }
+    }
+
+protected:
+    const char* category;
+    std::string name;
+    uint64_t start = 0;
+    uint64_t allocs = 0;
+    bool active = false;
+};
+
+} // namespace protogen
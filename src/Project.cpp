@@ -1,5 +1,14 @@
 #include "Project.hpp"
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <dlfcn.h>
+#endif
 
 namespace protogen {
 
@@ -59,6 +68,24 @@ void addPathEndSlash(std::string& path)
     }
 }
 
+void makeDir(const std::string& path)
+{
+    struct stat st;
+    if(::stat(path.c_str(), &st) == 0)
+    {
+        return;
+    }
+#ifdef _WIN32
+    int rv = _mkdir(path.c_str());
+#else
+    int rv = mkdir(path.c_str(), 0777);
+#endif
+    if(rv != 0)
+    {
+        throw std::runtime_error("Failed to create directory '" + path + "'");
+    }
+}
+
 std::string interpolateString(const std::string& str)
 {
     std::string::size_type pos = 0, prevPos = 0;
@@ -90,10 +117,29 @@ std::string interpolateString(const std::string& str)
     return rv;
 }
 
+std::string escapeDepPath(const std::string& path)
+{
+    std::string rv;
+    for(char c : path)
+    {
+        if(c == ' ' || c == '#')
+        {
+            rv += '\\';
+        }
+        else if(c == '$')
+        {
+            rv += '$';
+        }
+        rv += c;
+    }
+    return rv;
+}
+
 }
 
 bool Project::load(const std::string& fileName, const StrVector& optionsOverride)
 {
+    ProfileScope profile("load", fileName);
     FILE* f = fopen(fileName.c_str(), "rt");
     if(!f)
     {
@@ -108,6 +154,7 @@ bool Project::load(const std::string& fileName, const StrVector& optionsOverride
         projectSrc.push_back(buf);
     }
 
+    m_projectFileName = fileName;
     std::string basePath;
 
     {
@@ -183,6 +230,10 @@ bool Project::load(const std::string& fileName, const StrVector& optionsOverride
             setOptValue(m_enumExtensions, name, ext, value);
             setOptValue(m_fsExtensions, name, ext, value);
         }
+        else if(name == "out.writeIfChanged")
+        {
+            m_writeIfChanged = value == "true";
+        }
         else if(name == "out.protocol.extension")
         {
             setOptValue(m_protoExtensions, name, ext, value);
@@ -384,6 +435,27 @@ bool Project::load(const std::string& fileName, const StrVector& optionsOverride
         {
             m_printDepsDelimiter = interpolateString(value);
         }
+        else if(name == "depfile")
+        {
+            m_depFile = value;
+        }
+        else if(name == "template.compiled")
+        {
+            m_compiledTemplateLibs.push_back(value);
+        }
+        else if(name == "schemaCache")
+        {
+            m_schemaCache = value;
+        }
+        else if(name == "manifest")
+        {
+            m_manifestFile = value;
+        }
+        else if(name == "renderCache")
+        {
+            m_renderCacheDir = value;
+            addPathEndSlash(m_renderCacheDir);
+        }
         else if(name == "printGen")
         {
             m_printGen = true;
@@ -408,6 +480,16 @@ bool Project::load(const std::string& fileName, const StrVector& optionsOverride
         {
             m_searchInCurDur = value == "true";
         }
+        else if(name == "jobs")
+        {
+            int jobs = std::stoi(value);
+            if(jobs <= 0)
+            {
+                print("jobs value must be positive\n");
+                return false;
+            }
+            m_jobs = static_cast<size_t>(jobs);
+        }
         else
         {
             print("Unrecognized line:'%s'\n", line);
@@ -442,11 +524,45 @@ bool Project::load(const std::string& fileName, const StrVector& optionsOverride
         }
     }
 
-    m_parser.setVersionRequirement(m_reqMsgVersion);
-
     for(auto& searchPath : m_searchPaths)
     {
         addPathEndSlash(searchPath);
+    }
+
+    m_cfgProtoToGen = m_protoToGen;
+    m_cfgMsgToGen = m_msgToGen;
+    m_cfgEnumToGen = m_enumToGen;
+    m_cfgFsToGen = m_fsToGen;
+
+    loadModel();
+    loadCompiledTemplates();
+
+    if(!m_manifestFile.empty() && !m_dryrun)
+    {
+        m_trackInputs = true;
+        loadManifest();
+    }
+    if(!m_renderCacheDir.empty() && !m_dryrun)
+    {
+        m_trackInputs = true;
+        makeDir(m_renderCacheDir);
+    }
+
+    if(m_printDeps)
+    {
+        print("%s%s", fileName.c_str(), m_printDepsDelimiter.c_str());
+    }
+    return true;
+}
+
+#define VPRINTF(...) do{if(m_verbose){print(__VA_ARGS__);}} while(0)
+
+void Project::loadModel()
+{
+    m_parser.setVersionRequirement(m_reqMsgVersion);
+    m_parser.setJobs(m_jobs);
+    for(auto& searchPath : m_searchPaths)
+    {
         m_parser.addSearchPath(searchPath);
     }
     if(!m_searchInCurDur)
@@ -454,12 +570,21 @@ bool Project::load(const std::string& fileName, const StrVector& optionsOverride
         m_parser.disableSearchInCurDir();
     }
 
-#define VPRINTF(...) do{if(m_verbose){print(__VA_ARGS__);}} while(0)
-
-    for(auto& source : m_sources)
+    if(!m_schemaCache.empty() && m_parser.loadCache(m_schemaCache, m_sources))
+    {
+        VPRINTF("Loaded schema cache %s\n", m_schemaCache);
+    }
+    else
     {
-        VPRINTF("Parsing %s\n", source);
-        m_parser.parseFile(source.c_str());
+        for(auto& source : m_sources)
+        {
+            VPRINTF("Parsing %s\n", source);
+            m_parser.parseFile(source.c_str());
+        }
+        if(!m_schemaCache.empty() && !m_parser.saveCache(m_schemaCache, m_sources))
+        {
+            print("Failed to write schema cache %s\n", m_schemaCache);
+        }
     }
 
     for(auto& it : m_pkgToGen)
@@ -518,81 +643,201 @@ bool Project::load(const std::string& fileName, const StrVector& optionsOverride
         auto end = std::unique(m_protoToGen.begin(), m_protoToGen.end());
         m_protoToGen.erase(end, m_protoToGen.end());
     }
-    if(m_printDeps)
+}
+
+const Template& Project::getTemplate(FileFinder& ff, const std::string& fileName)
+{
+    std::string fullPath = ff.findFile(fileName);
+    auto it = m_templateCache.find(fullPath);
+    if(it != m_templateCache.end())
     {
-        print("%s%s", fileName.c_str(), m_printDepsDelimiter.c_str());
+        return *it->second;
     }
-    return true;
+    VPRINTF("Parsing template %s\n", fullPath);
+    std::unique_ptr<Template> t(new Template);
+    t->assignFileFinder(&ff);
+    t->Parse(fullPath);
+    t->assignFileFinder(nullptr);
+    for(auto info : m_compiledTemplates)
+    {
+        if(t->attachCompiled(info))
+        {
+            VPRINTF("Using compiled template %s for %s\n", info->fileName, fullPath);
+            break;
+        }
+    }
+    if(!t->getCompiled() && !m_compiledTemplates.empty())
+    {
+        VPRINTF("No compiled code matches content of template %s\n", fullPath);
+    }
+    if(m_debugMode)
+    {
+        print("Ops(%s): %d parsed, %d after optimization\n", fileName, static_cast<int>(t->parsedOpsCount()),
+              static_cast<int>(t->opsCount()));
+        print("Dump(%s):\n", fileName);
+        t->dump();
+    }
+    return *m_templateCache.emplace(fullPath, std::move(t)).first->second;
 }
 
-bool Project::generate()
+/*
+ * Options and data from project file are the same for every entity,
+ * only idxoption and idxdata depend on index of template.
+ * Names with '.' are set by initForX and entity loops, names assigned
+ * by templates or defined in loop items of project data can change
+ * during rendering, these are never folded.
+ */
+void Project::specializeTemplates(EntityKind kind, const StrVector& fileNames)
 {
-    FileFinder ff(m_searchPaths, m_searchInCurDur);
-    for(auto& it : m_protoToGen)
+    TemplateList& templates = m_templates[kind];
+    std::set<SymbolId> varying;
+    for(auto t : templates)
+    {
+        t->getAssignedSymbols(varying);
+    }
+    for(auto& it : m_dataSource.global.loops)
     {
-        m_dataSource.initForProtocol(m_parser, it);
-        for(size_t idx = 0; idx < m_protoTemplates.size(); idx++)
+        for(auto& item : it.second.items)
         {
-            VPRINTF("Parsing template %s for protocol %s\n", m_protoTemplates[idx], it);
-            for(auto& idxOption : m_idxOptions)
+            for(size_t id = 0; id < item.varSlots.size(); id++)
             {
-                if(idxOption.second.size() > idx)
+                if(item.varSlots[id] >= 0)
                 {
-                    m_dataSource.setBool(idxOption.first, idxOption.second[idx]);
+                    varying.insert(static_cast<SymbolId>(id));
                 }
             }
-            for(auto& dit : m_idxData)
+            for(size_t id = 0; id < item.boolSlots.size(); id++)
             {
-                if(dit.second.size() > idx)
+                if(item.boolSlots[id] >= 0)
                 {
-                    m_dataSource.setVar(dit.first, dit.second[idx]);
+                    varying.insert(static_cast<SymbolId>(id));
                 }
             }
-
-            protogen::Template t;
-            t.assignFileFinder(&ff);
-            t.Parse(m_protoTemplates[idx]);
-            if(m_debugMode)
-            {
-                print("Dump(%s):\n", m_protoTemplates[idx]);
-                t.dump();
-            }
-            std::string result = t.Generate(m_dataSource);
-            if(idx >= m_protoExtensions.size())
-            {
-                print("Extension for index %d not found\n", (int) idx);
-                return false;
-            }
-            std::string fileName = it;
-            if(m_protoPrefix.size() > idx)
+        }
+    }
+    Template::Constants consts;
+    consts.isFixed = [&varying](SymbolId id)
+    {
+        return !SymbolTable::isRelative(id) && !varying.count(id) &&
+                SymbolTable::name(id).find('.') == std::string::npos;
+    };
+    const DataSource::Namespace& global = m_dataSource.global;
+    for(size_t id = 0; id < global.varSlots.size(); id++)
+    {
+        if(global.varSlots[id] >= 0)
+        {
+            consts.vars[static_cast<SymbolId>(id)] = global.values[global.varSlots[id]];
+        }
+    }
+    for(size_t id = 0; id < global.boolSlots.size(); id++)
+    {
+        if(global.boolSlots[id] >= 0)
+        {
+            consts.bools[static_cast<SymbolId>(id)] = global.boolSlots[id] != 0;
+        }
+    }
+    for(size_t idx = 0; idx < templates.size(); idx++)
+    {
+        //generateJob sets these for each index in turn, so the last one stays for the rest
+        for(auto& idxOption : m_idxOptions)
+        {
+            if(idxOption.second.size() > idx)
             {
-                fileName.insert(0, m_protoPrefix[idx]);
+                consts.bools[SymbolTable::intern(idxOption.first)] = idxOption.second[idx];
             }
-            if(m_protoSuffix.size() > idx)
+        }
+        for(auto& dit : m_idxData)
+        {
+            if(dit.second.size() > idx)
             {
-                fileName += m_protoSuffix[idx];
+                consts.vars[SymbolTable::intern(dit.first)] = dit.second[idx];
             }
-            fileName += "." + m_protoExtensions[idx];
-            std::string fullPath = m_globalOutDir + m_protoOutDir[idx] + fileName;
+        }
+        //compiled code renders template as it is in source
+        if(templates[idx]->getCompiled())
+        {
+            continue;
+        }
+        std::unique_ptr<Template> t(new Template(*templates[idx]));
+        int folded = t->specialize(consts);
+        if(!folded)
+        {
+            continue;
+        }
+        VPRINTF("Folded %d constants into template %s for index %d\n", folded, fileNames[idx], static_cast<int>(idx));
+        if(m_debugMode)
+        {
+            print("Ops(%s, index %d): %d after folding constants\n", fileNames[idx], static_cast<int>(idx),
+                  static_cast<int>(t->opsCount()));
+            print("Dump(%s, index %d):\n", fileNames[idx], static_cast<int>(idx));
+            t->dump();
+        }
+        templates[idx] = t.get();
+        m_specializedTemplates[kind].push_back(std::move(t));
+    }
+}
 
-            if(m_printGen)
-            {
-                print("%s%s", fullPath, m_printGenDelimiter);
-            }
-            VPRINTF("Generating %s\n", fullPath);
-            if(!m_dryrun)
-            {
-                FILE* outProto = fopen(fullPath.c_str(), "wb");
-                if(!outProto)
-                {
-                    print("Failed to open file '%s' for writing\n", fullPath);
-                    return false;
-                }
-                fwrite(result.c_str(), result.length(), 1, outProto);
-                fclose(outProto);
-            }
+void Project::loadCompiledTemplates()
+{
+    for(auto& lib : m_compiledTemplateLibs)
+    {
+#ifdef _WIN32
+        print("Compiled templates are not supported on this platform, '%s' is ignored\n", lib);
+#else
+        //libraries are never unloaded, templates parsed after reload of project may still use them
+        void* handle = dlopen(lib.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if(!handle)
+        {
+            print("Failed to load compiled template '%s': %s\n", lib, dlerror());
+            continue;
+        }
+        void* func = dlsym(handle, PROTOGEN_COMPILED_TEMPLATE_FUNC);
+        if(!func)
+        {
+            print("Compiled template function not found in '%s'\n", lib);
+            continue;
+        }
+        const CompiledTemplateInfo* info = reinterpret_cast<CompiledTemplateFunc>(func)();
+        if(info->abi != compiledTemplateAbi)
+        {
+            print("Compiled template '%s' was built for another version of protogen\n", lib);
+            continue;
         }
-        typedef protogen::Protocol::MessagesVector MsgVector;
+        VPRINTF("Loaded compiled template %s from %s\n", info->fileName, lib);
+        m_compiledTemplates.push_back(info);
+#endif
+    }
+}
+
+bool Project::compileTemplate(const std::string& fileName, const std::string& outFile)
+{
+    FileFinder ff(m_searchPaths, m_searchInCurDur);
+    Template t;
+    t.assignFileFinder(&ff);
+    t.Parse(fileName);
+    std::string source = t.compile();
+    FileOutputSink out(outFile, true);
+    out.write(source.data(), source.size());
+    if(!out.commit())
+    {
+        print("%s\n", out.getError());
+        return false;
+    }
+    print("Compiled %s to %s\n", ff.findFile(fileName), outFile);
+    return true;
+}
+
+bool Project::generate()
+{
+    return generateKinds(allKinds);
+}
+
+bool Project::generateKinds(unsigned kindMask)
+{
+    ProfileScope profile("generate", m_projectFileName);
+    FileFinder ff(m_searchPaths, m_searchInCurDur);
+    for(auto& it : m_protoToGen)
+    {
         const protogen::Protocol& proto = m_parser.getProtocol(it);
         for(auto mit = proto.messages.begin(); mit != proto.messages.end(); mit++)
         {
@@ -697,164 +942,529 @@ bool Project::generate()
         m_fsToGen.erase(end, m_fsToGen.end());
     }
 
-    for(auto& it : m_msgToGen)
+    StrVector* toGen[ekCount] = {&m_protoToGen, &m_msgToGen, &m_enumToGen, &m_fsToGen};
+    StrVector* templates[ekCount] = {&m_protoTemplates, &m_msgTemplates, &m_enumTemplates, &m_fsTemplates};
+    StrVector* extensions[ekCount] = {&m_protoExtensions, &m_msgExtensions, &m_enumExtensions, &m_fsExtensions};
+    StrVector* prefix[ekCount] = {&m_protoPrefix, &m_msgPrefix, &m_enumPrefix, &m_fsPrefix};
+    StrVector* suffix[ekCount] = {&m_protoSuffix, &m_msgSuffix, &m_enumSuffix, &m_fsSuffix};
+    StrVector* outDir[ekCount] = {&m_protoOutDir, &m_msgOutDir, &m_enumOutDir, &m_fsOutDir};
+    static const char* kindNames[ekCount] = {"protocol", "message", "enum", "fieldset"};
+
+    GenJobs jobs;
+    for(int kind = 0; kind < ekCount; kind++)
     {
-        VPRINTF("Generating msg %s\n", it);
-        m_dataSource.initForMessage(m_parser, it);
-        for(size_t idx = 0; idx < m_msgTemplates.size(); idx++)
+        m_templates[kind].clear();
+        m_specializedTemplates[kind].clear();
+        if(toGen[kind]->empty() || !(kindMask & (1u << kind)))
         {
-            VPRINTF("Parsing template %s for message %s\n", m_msgTemplates[idx], it);
-            protogen::Template t;
-            t.assignFileFinder(&ff);
-            t.Parse(m_msgTemplates[idx]);
-            if(m_debugMode)
+            continue;
+        }
+        for(size_t idx = 0; idx < templates[kind]->size(); idx++)
+        {
+            if(idx >= extensions[kind]->size())
             {
-                print("Dump(%s):\n", m_msgTemplates[idx]);
-                t.dump();
+                print("Extension of %s for index %d not found\n", kindNames[kind], static_cast<int>(idx));
+                return false;
             }
-            std::string result = t.Generate(m_dataSource);
-            if(idx >= m_msgExtensions.size())
+            m_templates[kind].push_back(&getTemplate(ff, (*templates[kind])[idx]));
+        }
+        specializeTemplates(static_cast<EntityKind>(kind), *templates[kind]);
+        for(auto& it : *toGen[kind])
+        {
+            jobs.emplace_back();
+            GenJob& job = jobs.back();
+            job.kind = static_cast<EntityKind>(kind);
+            job.name = it;
+            for(size_t idx = 0; idx < templates[kind]->size(); idx++)
             {
-                print("Extension for index %d not found\n", (int) idx);
-                return false;
+                std::string fileName = it;
+                if(prefix[kind]->size() > idx)
+                {
+                    fileName.insert(0, (*prefix[kind])[idx]);
+                }
+                if(suffix[kind]->size() > idx)
+                {
+                    fileName += (*suffix[kind])[idx];
+                }
+                fileName += "." + (*extensions[kind])[idx];
+                job.outFiles.push_back(m_globalOutDir + (*outDir[kind])[idx] + fileName);
             }
-            std::string fileName = it;
-            if(m_msgPrefix.size() > idx)
+        }
+    }
+
+    m_templateFiles.insert(ff.foundFiles.begin(), ff.foundFiles.end());
+    if(m_trackInputs)
+    {
+        m_inputsHash = templatesHash();
+    }
+
+    size_t threadsCount = std::min(m_jobs, jobs.size());
+    VPRINTF("Generating %d entities using %d threads\n", static_cast<int>(jobs.size()),
+            static_cast<int>(threadsCount));
+    std::atomic<size_t> nextJob(0);
+    std::atomic<bool> failed(false);
+    auto worker = [this, &jobs, &nextJob, &failed]()
+    {
+        TemplateDataSource ds;
+        size_t jobIdx;
+        while(!failed && (jobIdx = nextJob++) < jobs.size())
+        {
+            GenJob& job = jobs[jobIdx];
+            generateJob(job, ds);
+            if(job.error || !job.errorMsg.empty())
             {
-                fileName.insert(0, m_msgPrefix[idx]);
+                failed = true;
             }
-            if(m_msgSuffix.size() > idx)
+        }
+    };
+    if(threadsCount <= 1)
+    {
+        worker();
+    }
+    else
+    {
+        std::vector<std::thread> threads;
+        for(size_t i = 1; i < threadsCount; i++)
+        {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for(auto& t : threads)
+        {
+            t.join();
+        }
+    }
+
+    if(m_trackInputs)
+    {
+        if(kindMask == allKinds && !failed)
+        {
+            m_manifest.clear();
+        }
+        for(auto& job : jobs)
+        {
+            for(size_t idx = 0; idx < job.outFiles.size(); idx++)
             {
-                fileName += m_msgSuffix[idx];
+                if(job.done && !job.error && job.errorMsg.empty() && idx < job.inputHashes.size())
+                {
+                    m_manifest[job.outFiles[idx]] = job.inputHashes[idx];
+                }
+                else
+                {
+                    m_manifest.erase(job.outFiles[idx]);
+                }
             }
-            fileName += "." + m_msgExtensions[idx];
-            std::string fullPath = m_globalOutDir + m_msgOutDir[idx] + fileName;
+        }
+        if(!m_manifestFile.empty() && !writeManifest())
+        {
+            return false;
+        }
+    }
+
+    int written = 0;
+    int skipped = 0;
+    for(auto& job : jobs)
+    {
+        if(failed && !job.done)
+        {
+            continue;
+        }
+        VPRINTF("Generating %s %s\n", kindNames[job.kind], job.name);
+        for(auto& fullPath : job.outFiles)
+        {
             if(m_printGen)
             {
                 print("%s%s", fullPath, m_printGenDelimiter);
             }
             VPRINTF("Generating %s\n", fullPath);
-            if(!m_dryrun)
+        }
+        if(job.error)
+        {
+            std::rethrow_exception(job.error);
+        }
+        if(!job.errorMsg.empty())
+        {
+            print("%s\n", job.errorMsg);
+            return false;
+        }
+        written += job.written;
+        skipped += job.skipped;
+    }
+    if((m_writeIfChanged || m_trackInputs) && !m_dryrun && !m_printGen && !m_printDeps)
+    {
+        print("Written %d files, skipped %d unchanged files\n", written, skipped);
+    }
+    if(!m_depFile.empty() && !m_dryrun && kindMask == allKinds && !writeDepFile(jobs, ff))
+    {
+        return false;
+    }
+
+    if(m_printDeps)
+    {
+        for(auto& file:m_parser.getAllFiles())
+        {
+            print("%s%s", file, m_printDepsDelimiter);
+        }
+        for(auto& file:ff.foundFiles)
+        {
+            print("%s%s", file, m_printDepsDelimiter);
+        }
+    }
+    return true;
+}
+
+bool Project::writeDepFile(const GenJobs& jobs, const FileFinder& ff)
+{
+    std::string content;
+    for(auto& job : jobs)
+    {
+        for(auto& outFile : job.outFiles)
+        {
+            if(!content.empty())
             {
-                FILE* outMsg = fopen(fullPath.c_str(), "wb");
-                if(!outMsg)
-                {
-                    print("Failed to open file '%s' for writing\n", fullPath);
-                    return false;
-                }
-                fwrite(result.c_str(), result.length(), 1, outMsg);
-                fclose(outMsg);
+                content += " \\\n ";
             }
+            content += escapeDepPath(outFile);
         }
     }
+    content += ": \\\n ";
+    content += escapeDepPath(m_projectFileName);
+    for(auto& file : m_parser.getAllFiles())
+    {
+        content += " \\\n ";
+        content += escapeDepPath(file);
+    }
+    for(auto& file : ff.foundFiles)
+    {
+        content += " \\\n ";
+        content += escapeDepPath(file);
+    }
+    content += "\n";
+    VPRINTF("Writing dependencies to %s\n", m_depFile);
+    FILE* f = fopen(m_depFile.c_str(), "wb");
+    if(!f)
+    {
+        print("Failed to open file '%s' for writing\n", m_depFile);
+        return false;
+    }
+    fwrite(content.c_str(), content.length(), 1, f);
+    fclose(f);
+    return true;
+}
+
+namespace {
+
+//change if generated output for the same inputs may differ from previous version
+const char manifestMagic[] = "protogen manifest 2";
+
+}
 
-    for(auto& it : m_enumToGen)
+void Project::loadManifest()
+{
+    m_manifest.clear();
+    struct stat st;
+    if(::stat(m_manifestFile.c_str(), &st) != 0)
+    {
+        return;
+    }
+    FileReader fr;
+    fr.Open(m_manifestFile);
+    const char* ptr = fr.data;
+    const char* end = fr.data + fr.fileSize;
+    bool header = true;
+    while(ptr < end)
     {
-        m_dataSource.initForEnum(m_parser, it);
-        for(size_t idx = 0; idx < m_enumTemplates.size(); idx++)
+        const char* eol = static_cast<const char*>(memchr(ptr, '\n', end - ptr));
+        if(!eol)
+        {
+            eol = end;
+        }
+        std::string line(ptr, eol);
+        ptr = eol + 1;
+        if(header)
         {
-            VPRINTF("Parsing template %s for enum %s\n", m_enumTemplates[idx], it);
-            protogen::Template t;
-            t.assignFileFinder(&ff);
-            t.Parse(m_enumTemplates[idx]);
-            if(m_debugMode)
+            if(line != manifestMagic)
             {
-                print("Dump(%s):\n", m_fsTemplates[idx]);
-                t.dump();
+                VPRINTF("Manifest %s is outdated, all files will be generated\n", m_manifestFile);
+                return;
             }
-            std::string result = t.Generate(m_dataSource);
-            if(idx >= m_enumExtensions.size())
+            header = false;
+            continue;
+        }
+        std::string::size_type pos = line.find(' ');
+        if(pos == std::string::npos)
+        {
+            continue;
+        }
+        m_manifest[line.substr(pos + 1)] = std::stoull(line.substr(0, pos), nullptr, 16);
+    }
+}
+
+bool Project::writeManifest()
+{
+    //sorted, so manifest doesn't change if outputs didn't
+    std::map<std::string, uint64_t> sorted(m_manifest.begin(), m_manifest.end());
+    std::string content = manifestMagic;
+    content += '\n';
+    char buf[32];
+    for(auto& it : sorted)
+    {
+        snprintf(buf, sizeof(buf), "%016llx ", static_cast<unsigned long long>(it.second));
+        content += buf;
+        content += it.first;
+        content += '\n';
+    }
+    VPRINTF("Writing manifest to %s\n", m_manifestFile);
+    FileOutputSink out(m_manifestFile, true);
+    out.write(content.c_str(), content.length());
+    if(!out.commit())
+    {
+        print("%s\n", out.getError());
+        return false;
+    }
+    return true;
+}
+
+//everything besides entity data that affects generated files: templates, options and data
+uint64_t Project::templatesHash()
+{
+    uint64_t rv = hashString(manifestMagic);
+    //project level options and data
+    rv = hashMix(rv + m_dataSource.contentHash());
+    for(auto& file : m_templateFiles)
+    {
+        FileReader fr;
+        fr.Open(file);
+        rv = hashMix(rv + hashString(file));
+        rv = hashMix(rv + hashData(fr.data, fr.fileSize));
+    }
+    StrVector* templates[ekCount] = {&m_protoTemplates, &m_msgTemplates, &m_enumTemplates, &m_fsTemplates};
+    for(int kind = 0; kind < ekCount; kind++)
+    {
+        for(auto& tmpl : *templates[kind])
+        {
+            rv = hashMix(rv + hashString(tmpl) + kind);
+        }
+    }
+    for(auto& idxOption : m_idxOptions)
+    {
+        rv = hashMix(rv + hashString(idxOption.first));
+        for(bool value : idxOption.second)
+        {
+            rv = hashMix(rv + value);
+        }
+    }
+    for(auto& dit : m_idxData)
+    {
+        rv = hashMix(rv + hashString(dit.first));
+        for(auto& value : dit.second)
+        {
+            rv = hashMix(rv + hashString(value));
+        }
+    }
+    return rv;
+}
+
+uint64_t Project::entityInputsHash(const GenJob& job)
+{
+    switch(job.kind)
+    {
+        case ekProtocol:
+            return TemplateDataSource::inputsHashForProtocol(m_parser, job.name);
+        case ekMessage:
+            return TemplateDataSource::inputsHashForMessage(m_parser, job.name);
+        case ekEnum:
+            return TemplateDataSource::inputsHashForEnum(m_parser, job.name);
+        case ekFieldSet:
+            return TemplateDataSource::inputsHashForFieldSet(m_parser, m_parser.getFieldset(job.name));
+        case ekCount:
+            break;
+    }
+    return 0;
+}
+
+std::string Project::renderCachePath(uint64_t hash) const
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(hash));
+    return m_renderCacheDir + buf;
+}
+
+std::unique_ptr<FileReader> Project::loadRendered(uint64_t hash) const
+{
+    std::string fileName = renderCachePath(hash);
+    struct stat st;
+    if(::stat(fileName.c_str(), &st) != 0)
+    {
+        return nullptr;
+    }
+    std::unique_ptr<FileReader> rv(new FileReader);
+    try
+    {
+        rv->Open(fileName);
+    }
+    catch(std::exception&)
+    {
+        return nullptr;
+    }
+    return rv;
+}
+
+void Project::storeRendered(uint64_t hash, const std::string& data) const
+{
+    //cache directory can be shared by concurrent runs, each one writes its own temporary file
+    std::string tmpSuffix = ".tmp" + std::to_string(getpid()) + "_" +
+            std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    FileOutputSink out(renderCachePath(hash), false, tmpSuffix);
+    out.write(data.data(), data.size());
+    if(!out.commit())
+    {
+        VPRINTF("Failed to store rendered output in cache: %s\n", out.getError());
+    }
+}
+
+void Project::generateJob(GenJob& job, TemplateDataSource& ds)
+{
+    try
+    {
+        const TemplateList& templates = m_templates[job.kind];
+        //outputs generated from the same inputs as recorded in manifest are kept
+        std::vector<bool> upToDate(templates.size(), false);
+        //previously rendered outputs with the same inputs found in render cache
+        std::vector<std::unique_ptr<FileReader>> rendered(templates.size());
+        bool needData = true;
+        if(m_trackInputs && !m_dryrun)
+        {
+            uint64_t entityHash = entityInputsHash(job);
+            needData = false;
+            for(size_t idx = 0; idx < templates.size(); idx++)
             {
-                print("Enum extension for index %d not found\n", (int) idx);
-                return false;
+                uint64_t hash = hashMix(entityHash + hashMix(m_inputsHash + idx));
+                job.inputHashes.push_back(hash);
+                auto it = m_manifest.find(job.outFiles[idx]);
+                struct stat st;
+                upToDate[idx] = it != m_manifest.end() && it->second == hash &&
+                        ::stat(job.outFiles[idx].c_str(), &st) == 0;
+                if(!upToDate[idx] && !m_renderCacheDir.empty())
+                {
+                    rendered[idx] = loadRendered(hash);
+                }
+                needData = needData || (!upToDate[idx] && !rendered[idx]);
             }
-            std::string fileName = it;
-            if(m_enumPrefix.size() > idx)
+        }
+        if(!needData)
+        {
+            //nothing to render, data source is not filled at all
+            for(size_t idx = 0; idx < templates.size() && job.errorMsg.empty(); idx++)
             {
-                fileName.insert(0, m_enumPrefix[idx]);
+                if(upToDate[idx])
+                {
+                    job.skipped++;
+                    continue;
+                }
+                FileOutputSink out(job.outFiles[idx], m_writeIfChanged);
+                out.write(rendered[idx]->data, rendered[idx]->fileSize);
+                if(!out.commit())
+                {
+                    job.errorMsg = out.getError();
+                }
+                else if(out.isUnchanged())
+                {
+                    job.skipped++;
+                }
+                else
+                {
+                    job.written++;
+                }
             }
-            if(m_enumSuffix.size() > idx)
+            job.done = true;
+            return;
+        }
+        ds = m_dataSource;
+        {
+            //loops are filled lazily, so most of their cost is accounted in render
+            ProfileScope profile("init", job.name);
+            switch(job.kind)
             {
-                fileName += m_enumSuffix[idx];
+                case ekProtocol:
+                    ds.initForProtocol(m_parser, job.name);
+                    break;
+                case ekMessage:
+                    ds.initForMessage(m_parser, job.name);
+                    break;
+                case ekEnum:
+                    ds.initForEnum(m_parser, job.name);
+                    break;
+                case ekFieldSet:
+                    ds.initForFieldSet(m_parser, m_parser.getFieldset(job.name));
+                    break;
+                case ekCount:
+                    break;
             }
-            fileName += "." + m_enumExtensions[idx];
-            std::string fullPath = m_globalOutDir + m_enumOutDir[idx] + fileName;
-            VPRINTF("Generating %s\n", fullPath);
-            if(!m_dryrun)
+        }
+        for(size_t idx = 0; idx < templates.size(); idx++)
+        {
+            for(auto& idxOption : m_idxOptions)
             {
-                FILE* outEnum = fopen(fullPath.c_str(), "wb");
-                if(!outEnum)
+                if(idxOption.second.size() > idx)
                 {
-                    print("Failed to open file '%s' for writing\n", fullPath);
-                    return false;
+                    ds.setBool(idxOption.first, idxOption.second[idx]);
                 }
-                fwrite(result.c_str(), result.length(), 1, outEnum);
-                fclose(outEnum);
             }
-        }
-    }
-
-    for(auto& it : m_fsToGen)
-    {
-        m_dataSource.initForFieldSet(m_parser, m_parser.getFieldset(it));
-        for(size_t idx = 0; idx < m_fsTemplates.size(); idx++)
-        {
-            VPRINTF("Parsing template %s for fieldset %s\n", m_fsTemplates[idx], it);
-            protogen::Template t;
-            t.assignFileFinder(&ff);
-            t.Parse(m_fsTemplates[idx]);
-            if(m_debugMode)
+            for(auto& dit : m_idxData)
             {
-                print("Dump(%s):\n", m_fsTemplates[idx]);
-                t.dump();
+                if(dit.second.size() > idx)
+                {
+                    ds.setVar(dit.first, dit.second[idx]);
+                }
             }
-            std::string result = t.Generate(m_dataSource);
-            if(idx >= m_fsExtensions.size())
+            if(m_dryrun)
             {
-                print("FieldSet extension for index %d not found\n", static_cast<int>(idx));
-                return false;
+                NullOutputSink out;
+                templates[idx]->Generate(ds, out);
+                continue;
             }
-            std::string fileName = it;
-            if(m_fsPrefix.size() > idx)
+            if(upToDate[idx])
             {
-                fileName.insert(0, m_fsPrefix[idx]);
+                job.skipped++;
+                continue;
             }
-            if(m_fsSuffix.size() > idx)
+            FileOutputSink out(job.outFiles[idx], m_writeIfChanged);
+            if(rendered[idx])
             {
-                fileName += m_fsSuffix[idx];
+                out.write(rendered[idx]->data, rendered[idx]->fileSize);
             }
-            fileName += "." + m_fsExtensions[idx];
-            std::string fullPath = m_globalOutDir + m_fsOutDir[idx] + fileName;
-            if(m_printGen)
+            else if(!m_renderCacheDir.empty())
             {
-                print("%s%s", fullPath, m_printGenDelimiter);
+                StringOutputSink str;
+                templates[idx]->Generate(ds, str);
+                out.write(str.str.data(), str.str.size());
+                storeRendered(job.inputHashes[idx], str.str);
             }
-            VPRINTF("Generating %s\n", fullPath);
-            if(!m_dryrun)
+            else
             {
-                FILE* outFs = fopen(fullPath.c_str(), "wb");
-                if(!outFs)
-                {
-                    print("Failed to open file '%s' for writing\n", fullPath);
-                    return false;
-                }
-                fwrite(result.c_str(), result.length(), 1, outFs);
-                fclose(outFs);
+                templates[idx]->Generate(ds, out);
+            }
+            if(!out.commit())
+            {
+                job.errorMsg = out.getError();
+                break;
+            }
+            if(out.isUnchanged())
+            {
+                job.skipped++;
+            }
+            else
+            {
+                job.written++;
             }
         }
     }
-    if(m_printDeps)
+    catch(...)
     {
-        for(auto& file:m_parser.getAllFiles())
-        {
-            print("%s%s", file, m_printDepsDelimiter);
-        }
-        for(auto& file:ff.foundFiles)
-        {
-            print("%s%s", file, m_printDepsDelimiter);
-        }
+        job.error = std::current_exception();
     }
-    return true;
+    job.done = true;
 }
 
 } // namespace protogen
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <exception>
 #include <functional>
 #include <initializer_list>
+#include <thread>
 #include "kst/Format.hpp"
 #include "Utility.hpp"
+#include "Profiler.hpp"
 #include "Template.hpp"
 #include "Parser.hpp"
 #include "TemplateDataSource.hpp"
@@ -14,6 +18,15 @@ class Project{
 public:
     bool load(const std::string& fileName, const StrVector& optionsOverride);
     bool generate();
+    /*
+     * Wait for changes of project, .def and template files and regenerate
+     * affected outputs, only files with changed content are written.
+     * Returns true if project file was changed and should be loaded again,
+     * false if watching is not possible.
+     */
+    bool watch();
+    //write C++ source of template compiled for template.compiled option
+    bool compileTemplate(const std::string& fileName, const std::string& outFile);
     void addSearchPath(std::string path)
     {
         m_searchPaths.push_back(std::move(path));
@@ -50,18 +63,70 @@ private:
 
 
     template <class... Args>
-    void print(Args... args)
+    void print(Args... args) const
     {
         if(m_outputFunc)
         {
-            auto& argList = kst::FormatBuffer().getArgList();
+            kst::FormatBuffer buf;
+            auto& argList = buf.getArgList();
             auto lst = {(argList,args)...};
             m_outputFunc(format(argList).Str());
         }
     }
 
+    typedef std::map<std::string, std::unique_ptr<Template>> TemplateCache;
+    typedef std::vector<const Template*> TemplateList;
+
+    enum EntityKind {
+        ekProtocol,
+        ekMessage,
+        ekEnum,
+        ekFieldSet,
+        ekCount
+    };
+
+    struct GenJob {
+        EntityKind kind = ekCount;
+        std::string name;
+        StrVector outFiles;
+        //hash of everything output file with the same index was generated from
+        std::vector<uint64_t> inputHashes;
+        std::string errorMsg;
+        std::exception_ptr error;
+        int written = 0;
+        int skipped = 0;
+        bool done = false;
+    };
+    typedef std::vector<GenJob> GenJobs;
+
+    static const unsigned allKinds = (1u << ekCount) - 1;
+
+    void loadModel();
+    void loadCompiledTemplates();
+    bool generateKinds(unsigned kindMask);
+    void loadManifest();
+    bool writeManifest();
+    uint64_t templatesHash();
+    uint64_t entityInputsHash(const GenJob& job);
+    std::string renderCachePath(uint64_t hash) const;
+    std::unique_ptr<FileReader> loadRendered(uint64_t hash) const;
+    void storeRendered(uint64_t hash, const std::string& data) const;
+    const Template& getTemplate(FileFinder& ff, const std::string& fileName);
+    void specializeTemplates(EntityKind kind, const StrVector& fileNames);
+    void generateJob(GenJob& job, TemplateDataSource& ds);
+    bool writeDepFile(const GenJobs& jobs, const FileFinder& ff);
+
     Parser m_parser;
     TemplateDataSource m_dataSource;
+    TemplateCache m_templateCache;
+    TemplateList m_templates[ekCount];
+    //copies of templates with project constants folded in, m_templates point to them
+    std::vector<std::unique_ptr<Template>> m_specializedTemplates[ekCount];
+    //output file to hash of its inputs, outputs with unchanged inputs are not generated again
+    typedef std::unordered_map<std::string, uint64_t> Manifest;
+    Manifest m_manifest;
+    bool m_trackInputs = false;
+    uint64_t m_inputsHash = 0;
 
     bool m_reqMsgVersion = false;
     bool m_debugMode = false;
@@ -71,8 +136,17 @@ private:
     bool m_printGen = false;
     bool m_genFieldsets = false;
     bool m_searchInCurDur = true;
+    bool m_writeIfChanged = false;
+    size_t m_jobs = std::max(std::thread::hardware_concurrency(), 1u);
 
+    std::string m_projectFileName;
     std::string m_globalOutDir;
+    std::string m_depFile;
+    std::string m_schemaCache;
+    std::string m_manifestFile;
+    std::string m_renderCacheDir;
+    StrVector m_compiledTemplateLibs;
+    std::vector<const CompiledTemplateInfo*> m_compiledTemplates;
     std::string m_printGenDelimiter = "\n";
     std::string m_printDepsDelimiter = "\n";
     StrVector m_protoOutDir;
@@ -93,6 +167,13 @@ private:
     StrVector m_enumToGen;
     StrVector m_fsToGen;
     StrVector m_pkgToGen;
+    //generation lists as specified in project, the ones above are expanded by loadModel and generate
+    StrVector m_cfgProtoToGen;
+    StrVector m_cfgMsgToGen;
+    StrVector m_cfgEnumToGen;
+    StrVector m_cfgFsToGen;
+    //all template files found by generate, including nested ones
+    std::set<std::string> m_templateFiles;
 
     StrVector m_msgTemplates;
     StrVector m_protoTemplates;
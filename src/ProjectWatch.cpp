@@ -0,0 +1,178 @@
+#include "Project.hpp"
+
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+namespace protogen {
+
+#define VPRINTF(...) do{if(m_verbose){print(__VA_ARGS__);}} while(0)
+
+#ifndef __linux__
+
+bool Project::watch()
+{
+    print("Watch mode is not supported on this platform\n");
+    return false;
+}
+
+#else
+
+namespace {
+
+std::string dirPrefix(const std::string& fileName)
+{
+    auto slashPos = fileName.rfind('/');
+    return slashPos == std::string::npos ? std::string() : fileName.substr(0, slashPos + 1);
+}
+
+}
+
+bool Project::watch()
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+    if(fd < 0)
+    {
+        print("Failed to initialize inotify\n");
+        return false;
+    }
+    //only changed outputs are touched, so build systems rebuild what really changed
+    m_writeIfChanged = true;
+    //entities with unchanged inputs are not rendered again, manifest is kept in memory if not set
+    m_trackInputs = true;
+    //directories are watched instead of files, editors often replace files by rename
+    std::map<int, std::set<std::string>> watchDirs;
+    const uint32_t watchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE;
+    print("Watching for changes of %s\n", m_projectFileName);
+    //files stay watched after failed parsing, so the fix is picked up
+    std::set<std::string> defFiles(m_sources.begin(), m_sources.end());
+    for(;;)
+    {
+        defFiles.insert(m_parser.getAllFiles().begin(), m_parser.getAllFiles().end());
+        std::set<std::string> watched = defFiles;
+        watched.insert(m_templateFiles.begin(), m_templateFiles.end());
+        watched.insert(m_projectFileName);
+        for(auto& file : watched)
+        {
+            std::string prefix = dirPrefix(file);
+            int wd = inotify_add_watch(fd, prefix.empty() ? "." : prefix.c_str(), watchMask);
+            if(wd >= 0)
+            {
+                watchDirs[wd].insert(prefix);
+            }
+        }
+
+        std::set<std::string> changed;
+        //collect events until there are no more for a while, saving in editor may produce several
+        int timeout = -1;
+        for(;;)
+        {
+            pollfd pfd = {fd, POLLIN, 0};
+            int rv = poll(&pfd, 1, timeout);
+            if(rv < 0)
+            {
+                close(fd);
+                print("Failed to wait for file changes\n");
+                return false;
+            }
+            if(rv == 0)
+            {
+                break;
+            }
+            alignas(inotify_event) char buf[4096];
+            ssize_t len = read(fd, buf, sizeof(buf));
+            for(ssize_t pos = 0; pos < len;)
+            {
+                const inotify_event* ev = reinterpret_cast<const inotify_event*>(buf + pos);
+                pos += sizeof(inotify_event) + ev->len;
+                auto it = watchDirs.find(ev->wd);
+                if(!ev->len || it == watchDirs.end())
+                {
+                    continue;
+                }
+                for(auto& prefix : it->second)
+                {
+                    std::string file = prefix + ev->name;
+                    if(watched.find(file) != watched.end())
+                    {
+                        changed.insert(file);
+                    }
+                }
+            }
+            if(!changed.empty())
+            {
+                timeout = 100;
+            }
+        }
+
+        for(auto& file : changed)
+        {
+            VPRINTF("Changed %s\n", file);
+        }
+        if(changed.find(m_projectFileName) != changed.end())
+        {
+            close(fd);
+            print("Project file changed, reloading\n");
+            return true;
+        }
+
+        unsigned kindMask = 0;
+        bool defChanged = false;
+        for(auto& file : changed)
+        {
+            if(defFiles.find(file) != defFiles.end())
+            {
+                defChanged = true;
+                kindMask = allKinds;
+                continue;
+            }
+            //template cache is keyed by found path, nested templates are parsed into their parents
+            m_templateCache.clear();
+            StrVector* templates[ekCount] = {&m_protoTemplates, &m_msgTemplates, &m_enumTemplates, &m_fsTemplates};
+            bool mainTemplate = false;
+            for(int kind = 0; kind < ekCount; kind++)
+            {
+                for(auto& tmpl : *templates[kind])
+                {
+                    if(FileReader::findFile(m_searchPaths, tmpl, m_searchInCurDur) == file)
+                    {
+                        kindMask |= 1u << kind;
+                        mainTemplate = true;
+                    }
+                }
+            }
+            if(!mainTemplate)
+            {
+                kindMask = allKinds;
+            }
+        }
+
+        try
+        {
+            if(defChanged)
+            {
+                print("Parsing changed sources\n");
+                m_parser = Parser();
+                m_protoToGen = m_cfgProtoToGen;
+                m_msgToGen = m_cfgMsgToGen;
+                m_enumToGen = m_cfgEnumToGen;
+                m_fsToGen = m_cfgFsToGen;
+                loadModel();
+            }
+            if(kindMask)
+            {
+                generateKinds(kindMask);
+            }
+        }
+        catch(std::exception& e)
+        {
+            print("Exception:\"%s\"\n", e.what());
+        }
+    }
+}
+
+#endif
+
+} // namespace protogen
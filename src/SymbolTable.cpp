@@ -0,0 +1,61 @@
+#include "SymbolTable.hpp"
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace protogen {
+
+namespace {
+
+struct SymbolStorage {
+    std::shared_timed_mutex mtx;
+    std::unordered_map<std::string, SymbolId> ids;
+    std::deque<std::string> names;
+
+    SymbolStorage()
+    {
+        ids.emplace(std::string(), SymbolTable::emptyId);
+        names.emplace_back();
+    }
+};
+
+SymbolStorage& storage()
+{
+    static SymbolStorage st;
+    return st;
+}
+
+}
+
+//emplace takes it by reference, so it needs a definition
+const SymbolId SymbolTable::emptyId;
+
+SymbolId SymbolTable::intern(const std::string& name)
+{
+    SymbolStorage& st = storage();
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(st.mtx);
+        auto it = st.ids.find(name);
+        if(it != st.ids.end())
+        {
+            return it->second;
+        }
+    }
+    std::unique_lock<std::shared_timed_mutex> lock(st.mtx);
+    auto res = st.ids.emplace(name, static_cast<SymbolId>(st.names.size()));
+    if(res.second)
+    {
+        st.names.push_back(name);
+    }
+    return res.first->second;
+}
+
+const std::string& SymbolTable::name(SymbolId id)
+{
+    SymbolStorage& st = storage();
+    std::shared_lock<std::shared_timed_mutex> lock(st.mtx);
+    return st.names[absolute(id)];
+}
+
+} // namespace protogen
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+
+namespace protogen {
+
+typedef int SymbolId;
+
+/*
+ * Process wide table of template variable names.
+ * Every name is interned once and then referenced by integer id.
+ * Names starting with '.' are relative to the current loop item,
+ * lookupId returns such ids bit inverted (negative).
+ */
+class SymbolTable {
+public:
+    static const SymbolId emptyId = 0;
+
+    static SymbolId intern(const std::string& name);
+
+    static const std::string& name(SymbolId id);
+
+    static SymbolId lookupId(const std::string& name)
+    {
+        SymbolId id = intern(name);
+        return !name.empty() && name[0] == '.' ? ~id : id;
+    }
+
+    static bool isRelative(SymbolId id)
+    {
+        return id < 0;
+    }
+
+    static SymbolId absolute(SymbolId id)
+    {
+        return id < 0 ? ~id : id;
+    }
+};
+
+} // namespace protogen
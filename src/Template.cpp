@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <stdio.h>
 #include <string.h>
 #include "Template.hpp"
@@ -71,28 +72,29 @@ bool myisspace(char c)
 
 static void skipSpaces(FileReader& fr)
 {
-    char c = 0;
-    while(!fr.eof() && myisspace(c = fr.getChar()))
-    {
-    }
-    if(!fr.eof() && !myisspace(c))
-    {
-        fr.putChar();
-    }
+    fr.skipWhile(myisspace);
 }
 
 static std::string getContent(FileReader& fr, const char* endChars, char& endChar)
 {
     std::string rv;
-    char c = 0;
-    while(!fr.eof() && !strchr(endChars, c = fr.getChar()))
+    fr.readWhile([endChars](char c) { return !strchr(endChars, c); }, rv);
+    if(!fr.eof())
     {
-        rv += c;
+        endChar = fr.getChar();
+    }
+    else
+    {
+        endChar = rv.empty() ? 0 : rv.back();
     }
-    endChar = c;
     return rv;
 }
 
+static bool isTextChar(char c)
+{
+    return c != '$' && c != 0x0a && c != 0x0d;
+}
+
 struct CmdStack {
     TmplCmd cmd;
     int idx;
@@ -186,6 +188,7 @@ Template::expandMacro(const MacroInfo& mi, const std::vector<std::string>& args,
 
 void Template::Parse(const std::string& fileName)
 {
+    ProfileScope profile("template.parse", fileName);
     macroMap.clear();
     FileReader fr;
     std::string file = fileName;
@@ -200,6 +203,165 @@ void Template::Parse(const std::string& fileName)
     Op op;
     op.op = opEnd;
     ops.push_back(op);
+    bindSymbols(ops);
+    parsedOps = countOps(ops);
+    optimize(ops);
+}
+
+void Template::pack(std::string& str, std::string::size_type start)
+{
+    std::string::size_type from = start;
+    std::string::size_type end = str.length();
+    while(from < end && isspace((unsigned char)str[from]))
+    {
+        from++;
+    }
+    while(end > from && isspace((unsigned char)str[end - 1]))
+    {
+        end--;
+    }
+    std::string::size_type to = start;
+    bool prevSpace = false;
+    for(; from < end; from++)
+    {
+        char c = str[from];
+        if(c == 0x0a || c == 0x0d || c == 0x09)
+        {
+            c = ' ';
+        }
+        if(c == ' ')
+        {
+            if(prevSpace)
+            {
+                continue;
+            }
+            prevSpace = true;
+        }
+        else
+        {
+            prevSpace = false;
+        }
+        str[to++] = c;
+    }
+    str.resize(to);
+}
+
+void Template::bindSymbols(OpVector& ops)
+{
+    for(auto& op : ops)
+    {
+        switch(op.op)
+        {
+            case opVar:
+            case opLoop:
+            case opIfdef:
+            case opIfndef:
+            case opSelect:
+            case opSetBool:
+            case opSetVar:
+                op.sym = SymbolTable::lookupId(op.value);
+                break;
+            default:
+                break;
+        }
+        bindSymbols(op.varValue);
+    }
+}
+
+void Template::SelectTable::build(const SelectMap& sm)
+{
+    slots.clear();
+    defaultTarget = -1;
+    size_t size = 4;
+    while(size < sm.size() * 2)
+    {
+        size *= 2;
+    }
+    mask = size - 1;
+    slots.resize(size);
+    for(auto& it : sm)
+    {
+        //default is stored with empty value, empty case value falls back to it as well
+        if(it.first.empty())
+        {
+            defaultTarget = it.second;
+            continue;
+        }
+        uint64_t hash = hashString(it.first);
+        size_t pos = hash & mask;
+        while(slots[pos].target != -1)
+        {
+            pos = (pos + 1) & mask;
+        }
+        slots[pos].value = it.first;
+        slots[pos].hash = hash;
+        slots[pos].target = it.second;
+    }
+}
+
+void Template::compileBool(const BoolTree& bt, BoolCode& code)
+{
+    switch(bt.bop)
+    {
+        case bopAnd:
+        case bopOr:
+        {
+            compileBool(*bt.left, code);
+            size_t jumpIdx = code.size();
+            code.push_back(BoolInstr{bt.bop == bopAnd ? bopJumpIfFalse : bopJumpIfTrue, 0, 0});
+            compileBool(*bt.right, code);
+            code[jumpIdx].arg = static_cast<int>(code.size());
+            break;
+        }
+        case bopNot:
+            compileBool(*bt.left, code);
+            code.push_back(BoolInstr{bopNot, 0, 0});
+            break;
+        case bopVar:
+        case bopNotVar:
+            code.push_back(BoolInstr{bt.bop, SymbolTable::lookupId(bt.varName), 0});
+            break;
+        case bopEqVal:
+        case bopNeqVal:
+        {
+            auto it = std::find(boolLiterals.begin(), boolLiterals.end(), bt.value);
+            if(it == boolLiterals.end())
+            {
+                it = boolLiterals.insert(it, bt.value);
+            }
+            int literal = static_cast<int>(it - boolLiterals.begin());
+            code.push_back(BoolInstr{bt.bop, SymbolTable::lookupId(bt.varName), literal});
+            break;
+        }
+        case bopEqVar:
+        case bopNeqVar:
+            code.push_back(BoolInstr{bt.bop, SymbolTable::lookupId(bt.varName), SymbolTable::lookupId(bt.value)});
+            break;
+        default:
+            //empty expression, fails on evaluation as before
+            code.push_back(BoolInstr{bopNone, 0, 0});
+            break;
+    }
+}
+
+/*
+ * Nested && and || produce jumps to other jumps. Jump to the same kind
+ * of jump will take it too, jump to opposite one will not.
+ */
+void Template::threadBoolJumps(BoolCode& code)
+{
+    const int size = static_cast<int>(code.size());
+    for(auto& bi : code)
+    {
+        if(bi.bop != bopJumpIfFalse && bi.bop != bopJumpIfTrue)
+        {
+            continue;
+        }
+        while(bi.arg < size && (code[bi.arg].bop == bopJumpIfFalse || code[bi.arg].bop == bopJumpIfTrue))
+        {
+            bi.arg = code[bi.arg].bop == bi.bop ? code[bi.arg].arg : bi.arg + 1;
+        }
+    }
 }
 
 enum BoolTerm {
@@ -486,10 +648,17 @@ void Template::Parse(FileReader& fr)
 
     char c;
     int line, col;
+    //position where pending static text starts
+    int textLine = fr.line, textCol = fr.col;
     while(!fr.eof())
     {
         line = fr.line;
         col = fr.col;
+        if(curText.empty() && curLine.empty())
+        {
+            textLine = line;
+            textCol = col;
+        }
         c = fr.getChar();
         if(line != fr.line)
         {
@@ -520,6 +689,9 @@ void Template::Parse(FileReader& fr)
                 {
                     Op op;
                     op.op = opText;
+                    op.line = textLine;
+                    op.col = textCol;
+                    op.fidx = fr.file;
                     op.value = curText + curLine;
                     ops.push_back(op);
                     curText = "";
@@ -636,7 +808,10 @@ void Template::Parse(FileReader& fr)
                         op.fidx = fr.file;
                         try
                         {
-                            parseBool(op.value, op.boolValue);
+                            BoolTree bt;
+                            parseBool(op.value, bt);
+                            compileBool(bt, op.boolCode);
+                            threadBoolJumps(op.boolCode);
                         }
                         catch(BoolExprParsingExpr& e)
                         {
@@ -725,6 +900,9 @@ void Template::Parse(FileReader& fr)
                         Op op;
                         op.op = opJump;
                         op.jidx = stack.back().idx;
+                        op.line = line;
+                        op.col = col;
+                        op.fidx = fr.file;
                         ops.push_back(op);
                         ops[stack.back().idx].jidx = ops.size();
                         stack.pop_back();
@@ -767,7 +945,7 @@ void Template::Parse(FileReader& fr)
                         {
                             throw TemplateParsingException("Unexpected end of select command", fr.fileName, line, col);
                         }
-                        ops[stack.back().idx].smap = sm;
+                        ops[stack.back().idx].select.build(sm);
                         stack.pop_back();
                     }
                     else
@@ -790,6 +968,9 @@ void Template::Parse(FileReader& fr)
                         stack.back().idx2 = ops.size();
                         Op op;
                         op.op = opJump;
+                        op.line = line;
+                        op.col = col;
+                        op.fidx = fr.file;
                         ops.push_back(op);
                     }
                     stack.emplace_back(tcCase, ops.size(), line, col, getContent(fr, "$", c));
@@ -802,6 +983,9 @@ void Template::Parse(FileReader& fr)
                         stack.back().idx2 = ops.size();
                         Op op;
                         op.op = opJump;
+                        op.line = line;
+                        op.col = col;
+                        op.fidx = fr.file;
                         ops.push_back(op);
                     }
                     stack.emplace_back(tcDefault, ops.size(), line, col, "");
@@ -899,6 +1083,9 @@ void Template::Parse(FileReader& fr)
                             {
                                 Op vop;
                                 vop.op = opText;
+                                vop.line = vl;
+                                vop.col = vc + lastPos;
+                                vop.fidx = fr.file;
                                 vop.value = value.substr(lastPos, pos - lastPos);
                                 op.varValue.push_back(vop);
                             }
@@ -921,6 +1108,9 @@ void Template::Parse(FileReader& fr)
                         {
                             Op vop;
                             vop.op = opText;
+                            vop.line = vl;
+                            vop.col = vc + lastPos;
+                            vop.fidx = fr.file;
                             vop.value = value.substr(lastPos);
                             op.varValue.push_back(vop);
                         }
@@ -965,12 +1155,7 @@ void Template::Parse(FileReader& fr)
                         //printf("Expanding macro:'%s'->'%s'\n",mit->second.macroText.c_str(),macroTxt.c_str());
                         //savedFr=fr;
                         FileReader macroFr;
-                        macroFr.fileName = fr.fileName;
-                        macroFr.fileName += "::";
-                        macroFr.fileName += macroName;
-                        macroFr.source.insert(macroFr.source.begin(), macroTxt.c_str(),
-                                macroTxt.c_str() + macroTxt.length());
-                        macroFr.fileSize = macroTxt.length();
+                        macroFr.Assign(fr.fileName + "::" + macroName, macroTxt);
                         macroFr.file = files.size();
                         files.push_back(macroFr.fileName);
                         Parse(macroFr);
@@ -1039,8 +1224,10 @@ void Template::Parse(FileReader& fr)
         }
         else
         {
+            std::string::size_type from = curLine.length();
             curLine += c;
-            if(c != ' ' && c != '\t')
+            fr.readWhile(isTextChar, curLine);
+            if(curLine.find_first_not_of(" \t", from) != std::string::npos)
             {
                 lineHasStaticText = true;
             }
@@ -1050,6 +1237,9 @@ void Template::Parse(FileReader& fr)
     {
         Op op;
         op.op = opText;
+        op.line = textLine;
+        op.col = textCol;
+        op.fidx = fr.file;
         op.value = curText + curLine;
         ops.push_back(op);
         curText = "";
@@ -1079,7 +1269,50 @@ void Template::Parse(FileReader& fr)
     }
 }
 
-void Template::dump()
+void Template::recordProfile(OpProfile& prof) const
+{
+    prof.leave();
+    std::map<std::pair<int, int>, TemplateLineStat> lines;
+    for(auto& it : prof.stats)
+    {
+        const Op& op = *it.first;
+        TemplateLineStat& ls = lines[std::make_pair(op.fidx, op.line)];
+        ls.execs += it.second.execs;
+        ls.time += it.second.time;
+        switch(op.op)
+        {
+            case opLoop:
+                ls.loopIterations += it.second.hits;
+                break;
+            case opVar:
+                ls.varLookups += it.second.execs;
+                break;
+            case opSelect:
+                ls.selectMisses += it.second.hits;
+                break;
+            case opPackEnd:
+                ls.packTime += it.second.time;
+                break;
+            default:
+                break;
+        }
+    }
+    std::vector<TemplateLineStat> rv;
+    for(auto& it : lines)
+    {
+        rv.push_back(it.second);
+        rv.back().file = files[it.first.first];
+        rv.back().line = it.first.second;
+    }
+    Profiler::recordTemplateLines(rv);
+}
+
+void Template::dump() const
+{
+    dump(ops);
+}
+
+void Template::dump(const OpVector& ops) const
 {
     for(size_t i = 0; i < ops.size(); i++)
     {
@@ -1122,10 +1355,7 @@ void Template::dump()
             case opSetVar:
             {
                 printf("setvar:%s:", ops[i].value.c_str());
-                OpVector& v = ops[i].varValue;
-                ops.swap(v);
-                dump();
-                ops.swap(v);
+                dump(ops[i].varValue);
                 break;
             }
             case opError:
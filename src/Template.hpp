@@ -5,9 +5,17 @@
 #include <string>
 #include <ctype.h>
 #include <exception>
+#include <functional>
+#include <set>
 #include <utility>
 #include <memory>
+#include <unordered_map>
 #include "FileReader.hpp"
+#include "SymbolTable.hpp"
+#include "OutputSink.hpp"
+#include "Profiler.hpp"
+#include "Utility.hpp"
+#include "CompiledTemplate.hpp"
 
 namespace protogen {
 
@@ -118,84 +126,505 @@ public:
 
     void Parse(const std::string& fileName);
 
-    void dump();
+    void dump() const;
 
+    //number of ops right after parsing and after optimization, nested ones included
+    size_t parsedOpsCount() const
+    {
+        return parsedOps;
+    }
+
+    size_t opsCount() const
+    {
+        return countOps(ops);
+    }
+
+    //hash of content of all files template was parsed from
+    uint64_t sourceHash() const;
+
+    //translate template to C++ source of shared object for use with attachCompiled
+    std::string compile() const;
+
+    /*
+     * Render template with compiled code instead of interpreter.
+     * Returns false if info is not compiled from the same template sources.
+     */
+    bool attachCompiled(const CompiledTemplateInfo* info);
+
+    const CompiledTemplateInfo* getCompiled() const
+    {
+        return compiled;
+    }
+
+    /*
+     * Values that are the same for every entity template is rendered for.
+     * Symbols for which isFixed returns true are not set by anything else,
+     * so they are undefined if they are not in vars or bools.
+     */
+    struct Constants {
+        std::unordered_map<SymbolId, std::string> vars;
+        std::unordered_map<SymbolId, bool> bools;
+        std::function<bool(SymbolId)> isFixed;
+
+        const std::string* findVar(SymbolId id) const
+        {
+            if(!isFixed(id))
+            {
+                return nullptr;
+            }
+            auto it = vars.find(id);
+            return it == vars.end() ? nullptr : &it->second;
+        }
+
+        //0 - false, 1 - true, -1 - unknown
+        int findBool(SymbolId id) const
+        {
+            if(!isFixed(id))
+            {
+                return -1;
+            }
+            auto it = bools.find(id);
+            return it == bools.end() ? -1 : it->second;
+        }
+
+        //0 - undefined, 1 - defined, -1 - unknown
+        int isDefined(SymbolId id) const
+        {
+            if(!isFixed(id))
+            {
+                return -1;
+            }
+            return vars.count(id) || bools.count(id);
+        }
+    };
+
+    //symbols assigned by $setvar$ and $setbool$
+    void getAssignedSymbols(std::set<SymbolId>& syms) const;
+
+    /*
+     * Fold constants into template: conditions and selects on them become jumps,
+     * their values are rendered to text and unreachable ops are removed.
+     * Returns number of folded ops, 0 if template doesn't depend on constants.
+     */
+    int specialize(const Constants& consts);
+
+    template<class DataSource>
+    std::string Generate(DataSource& ds) const
+    {
+        StringOutputSink out;
+        Generate(ds, out);
+        return std::move(out.str);
+    }
+
+    template<class DataSource>
+    void Generate(DataSource& ds, IOutputSink& out) const
+    {
+        ProfileScope profile("render", files.front());
+        if(compiled)
+        {
+            CompiledContext<DataSource> ctx(ds, files);
+            compiled->render(ctx, compiledSyms.data(), out);
+            return;
+        }
+        if(!Profiler::templatesEnabled())
+        {
+            Generate(ops, ds, out);
+            return;
+        }
+        OpProfile prof;
+        try
+        {
+            Generate(ops, ds, out, &prof);
+        }
+        catch(...)
+        {
+            recordProfile(prof);
+            throw;
+        }
+        recordProfile(prof);
+    }
+
+protected:
+    enum OpCode {
+        opText,
+        opVar,
+        opLoop,
+        opIf,
+        opIfdef,
+        opIfndef,
+        opJump,
+        opSelect,
+        opPack,
+        opPackEnd,
+        opSetBool,
+        opSetVar,
+        opError,
+        opEnd
+    };
+    enum VarFlags {
+        varFlagNone,
+        varFlagUc,
+        varFlagUcf,
+        varFlagHex
+    };
+    typedef std::map<std::string, int> SelectMap;
+
+    /*
+     * Case values of $select$ in open addressing hash table,
+     * default case is kept separately.
+     * find returns index of op to jump to or -1.
+     */
+    struct SelectTable {
+        struct Slot {
+            std::string value;
+            uint64_t hash = 0;
+            int target = -1;
+        };
+        std::vector<Slot> slots;
+        size_t mask = 0;
+        int defaultTarget = -1;
+
+        void build(const SelectMap& sm);
+
+        int find(const std::string& value) const
+        {
+            if(slots.empty())
+            {
+                return -1;
+            }
+            uint64_t hash = hashString(value);
+            for(size_t pos = hash & mask;; pos = (pos + 1) & mask)
+            {
+                const Slot& slot = slots[pos];
+                if(slot.target == -1)
+                {
+                    return -1;
+                }
+                if(slot.hash == hash && slot.value == value)
+                {
+                    return slot.target;
+                }
+            }
+        }
+    };
+
+    enum BoolOp {
+        bopNone,
+        bopVar,
+        bopNotVar,
+        bopNot,
+        bopEqVal,
+        bopNeqVal,
+        bopEqVar,
+        bopNeqVar,
+        bopAnd,
+        bopOr,
+        //used only in compiled expressions
+        bopJumpIfFalse,
+        bopJumpIfTrue
+    };
+
+    //parsed $if$ expression, compiled to BoolCode before use
+    struct BoolTree {
+        BoolOp bop;
+        std::string varName;
+        std::string value;
+        std::unique_ptr<BoolTree> left, right;
+
+        BoolTree() : bop(bopNone)
+        {
+        }
+
+        BoolTree(const BoolTree& other) : bop(other.bop), varName(other.varName), value(other.value)
+        {
+            if(other.left)
+            {
+                left = std::make_unique<BoolTree>(*other.left);
+            }
+            if(other.right)
+            {
+                right = std::make_unique<BoolTree>(*other.right);
+            }
+        }
+
+        BoolTree(BoolTree&&) = default;
+    };
+
+    /*
+     * Instruction of compiled $if$ expression.
+     * Result of last test is kept in accumulator, && and || are jumps
+     * over right operand that depend on it.
+     * arg is index in boolLiterals for bopEqVal/bopNeqVal,
+     * symbol for bopEqVar/bopNeqVar and target for jumps.
+     */
+    struct BoolInstr {
+        BoolOp bop;
+        SymbolId sym;
+        int arg;
+    };
+    typedef std::vector<BoolInstr> BoolCode;
+
+    template<class DataSource>
+    bool evalBool(const BoolCode& code, DataSource& ds) const
+    {
+        bool acc = false;
+        const int size = static_cast<int>(code.size());
+        for(int pc = 0; pc < size;)
+        {
+            const BoolInstr& bi = code[pc++];
+            switch(bi.bop)
+            {
+                case bopVar:
+                    acc = ds.getBool(bi.sym);
+                    break;
+                case bopNotVar:
+                    acc = !ds.getBool(bi.sym);
+                    break;
+                case bopEqVal:
+                    acc = ds.getVar(bi.sym) == boolLiterals[bi.arg];
+                    break;
+                case bopNeqVal:
+                    acc = ds.getVar(bi.sym) != boolLiterals[bi.arg];
+                    break;
+                case bopEqVar:
+                    acc = ds.getVar(bi.sym) == ds.getVar(bi.arg);
+                    break;
+                case bopNeqVar:
+                    acc = ds.getVar(bi.sym) != ds.getVar(bi.arg);
+                    break;
+                case bopNot:
+                    acc = !acc;
+                    break;
+                case bopJumpIfFalse:
+                    if(!acc)
+                    {
+                        pc = bi.arg;
+                    }
+                    break;
+                case bopJumpIfTrue:
+                    if(acc)
+                    {
+                        pc = bi.arg;
+                    }
+                    break;
+                default:
+                    throw std::runtime_error("invalid bool op!");
+            }
+        }
+        return acc;
+    }
+
+    struct Op;
+    typedef std::vector<Op> OpVector;
+
+    struct Op {
+
+        OpCode op = opEnd;
+        std::string value;
+        SymbolId sym = 0;
+        OpVector varValue;
+        BoolCode boolCode;
+        int jidx = -1;
+        int line = 0;
+        int col = 0;
+        int fidx = 0;
+        VarFlags varFlag = varFlagNone;
+        bool boolSetValue = false;
+        SelectTable select;
+    };
+
+    //per op counters collected while template profiling is enabled
+    struct OpProfile {
+        struct OpStat {
+            uint64_t execs = 0;
+            uint64_t time = 0;
+            //loop iterations or select misses
+            uint64_t hits = 0;
+        };
+        std::unordered_map<const Op*, OpStat> stats;
+        OpStat* cur = nullptr;
+        uint64_t start = 0;
+
+        //time since previous call is charged to previously executed op
+        OpStat& enter(const Op& op)
+        {
+            resume(op);
+            cur->execs++;
+            return *cur;
+        }
+
+        void resume(const Op& op)
+        {
+            uint64_t now = Profiler::now();
+            if(cur)
+            {
+                cur->time += now - start;
+            }
+            cur = &stats[&op];
+            start = now;
+        }
+
+        void leave()
+        {
+            if(cur)
+            {
+                cur->time += Profiler::now() - start;
+                cur = nullptr;
+            }
+        }
+    };
+
+    void recordProfile(OpProfile& prof) const;
+
+    //access to data source for compiled template
     template<class DataSource>
-    std::string Generate(DataSource& ds)
+    class CompiledContext : public ITemplateContext {
+    public:
+        CompiledContext(DataSource& argDs, const StrVector& argFiles) : ds(argDs), files(argFiles)
+        {
+        }
+
+        const std::string& getVar(SymbolId id) override
+        {
+            return ds.getVar(id);
+        }
+
+        bool getBool(SymbolId id) override
+        {
+            return ds.getBool(id);
+        }
+
+        bool haveVar(SymbolId id) override
+        {
+            return ds.haveVar(id);
+        }
+
+        bool loopNext(SymbolId id) override
+        {
+            return ds.loopNext(id);
+        }
+
+        void setVar(SymbolId id, const std::string& value) override
+        {
+            ds.setVar(id, value);
+        }
+
+        void setBool(SymbolId id, bool value) override
+        {
+            ds.setBool(id, value);
+        }
+
+        void pack(std::string& str) override
+        {
+            Template::pack(str, 0);
+        }
+
+        void fail(const char* msg, int fidx, int line, int col) override
+        {
+            ds.dumpContext();
+            std::string err = "Exception during code generation:'";
+            err += msg;
+            err += "'";
+            throw TemplateParsingException(err, files[fidx], line, col);
+        }
+
+    protected:
+        DataSource& ds;
+        const StrVector& files;
+    };
+
+    const CompiledTemplateInfo* compiled = nullptr;
+    std::vector<SymbolId> compiledSyms;
+
+    template<class DataSource>
+    void Generate(const OpVector& ops, DataSource& ds, IOutputSink& out, OpProfile* prof = nullptr) const
     {
         int idx = 0;
-        std::string rv;
-        std::string::size_type packStart = 0;
+        //pack regions have to be complete before they can be compacted
+        std::string packBuf;
         int packCnt = 0;
+        auto put = [&out, &packBuf, &packCnt](const std::string& str)
+        {
+            if(packCnt)
+            {
+                packBuf += str;
+            }
+            else
+            {
+                out.write(str);
+            }
+        };
         try
         {
             for(; ops[idx].op != opEnd;)
             {
                 //printf("%d,%d,%d\n",idx,ops[idx].line,ops[idx].col);fflush(stdout);
+                if(prof)
+                {
+                    prof->enter(ops[idx]);
+                }
                 switch(ops[idx].op)
                 {
                     case opText:
-                        rv += ops[idx].value;
+                        put(ops[idx].value);
                         break;
                     case opVar:
                     {
                         if(ops[idx].varFlag == varFlagNone)
                         {
-                            rv += ds.getVar(ops[idx].value);
+                            put(ds.getVar(ops[idx].sym));
                         }
                         else if(ops[idx].varFlag == varFlagUcf)
                         {
-                            std::string val = ds.getVar(ops[idx].value);
+                            std::string val = ds.getVar(ops[idx].sym);
                             if(val.length())
                             {
                                 val[0] = toupper(val[0]);
                             }
-                            rv += val;
+                            put(val);
                         }
                         else if(ops[idx].varFlag == varFlagUc)
                         {
-                            std::string val = ds.getVar(ops[idx].value);
+                            std::string val = ds.getVar(ops[idx].sym);
                             for(std::string::size_type i = 0; i < val.length(); i++)
                             {
                                 val[i] = toupper(val[i]);
                             }
-                            rv += val;
+                            put(val);
                         }
                         else if(ops[idx].varFlag == varFlagHex)
                         {
-                            int val = atoi(ds.getVar(ops[idx].value).c_str());
+                            int val = atoi(ds.getVar(ops[idx].sym).c_str());
                             char buf[32];
                             sprintf(buf, "0x%x", val);
-                            rv += buf;
+                            put(buf);
                         }
                         break;
                     }
                     case opSetBool:
                     {
-                        ds.setBool(ops[idx].value, ops[idx].boolSetValue);
+                        ds.setBool(ops[idx].sym, ops[idx].boolSetValue);
                         break;
                     }
                     case opSetVar:
                     {
-                        std::string& varName = ops[idx].value;
-                        OpVector& varOps = ops[idx].varValue;
-                        varOps.swap(ops);
-                        try
+                        StringOutputSink value;
+                        Generate(ops[idx].varValue, ds, value, prof);
+                        if(prof)
                         {
-                            ds.setVar(varName, Generate(ds));
+                            prof->resume(ops[idx]);
                         }
-                        catch(...)
-                        {
-                            varOps.swap(ops);
-                            throw;
-                        }
-                        varOps.swap(ops);
+                        ds.setVar(ops[idx].sym, value.str);
                         break;
                     }
                     case opLoop:
                     {
-                        if(ds.loopNext(ops[idx].value))
+                        if(ds.loopNext(ops[idx].sym))
                         {
+                            if(prof)
+                            {
+                                prof->cur->hits++;
+                            }
                             break;
                         }
                         idx = ops[idx].jidx;
@@ -203,7 +632,7 @@ public:
                     }
                     case opIf:
                     {
-                        if(ops[idx].boolValue.eval(ds))
+                        if(evalBool(ops[idx].boolCode, ds))
                         {
                             break;
                         }
@@ -215,7 +644,7 @@ public:
                     }
                     case opIfdef:
                     {
-                        if(ds.haveVar(ops[idx].value))
+                        if(ds.haveVar(ops[idx].sym))
                         {
                             break;
                         }
@@ -224,7 +653,7 @@ public:
                     }
                     case opIfndef:
                     {
-                        if(!ds.haveVar(ops[idx].value))
+                        if(!ds.haveVar(ops[idx].sym))
                         {
                             break;
                         }
@@ -236,69 +665,38 @@ public:
                         continue;
                     case opSelect:
                     {
-                        SelectMap::iterator it = ops[idx].smap.find(ds.getVar(ops[idx].value));
-                        if(it == ops[idx].smap.end())
+                        const std::string& value = ds.getVar(ops[idx].sym);
+                        int target = ops[idx].select.find(value);
+                        if(target == -1)
                         {
-                            it = ops[idx].smap.find("");
-                            if(it == ops[idx].smap.end())
+                            if(prof)
+                            {
+                                prof->cur->hits++;
+                            }
+                            target = ops[idx].select.defaultTarget;
+                            if(target == -1)
                             {
-                                throw CaseNotFoundException(ops[idx].value, ds.getVar(ops[idx].value));
+                                throw CaseNotFoundException(ops[idx].value, value);
                             }
                         }
-                        idx = it->second;
+                        idx = target;
                         continue;
                     }
                     case opPack:
-                        if(packCnt == 0)
-                        {
-                            packStart = rv.length();
-                        }
                         packCnt++;
-                        //printf("pack:%d(start=%lu)\n",packCnt,packStart);
+                        //printf("pack:%d\n",packCnt);
                         break;
                     case opPackEnd:
                     {
                         packCnt--;
-                        //printf("packend:%d(start=%lu)\n",packCnt,packStart);
+                        //printf("packend:%d\n",packCnt);
                         if(packCnt != 0)
                         {
                             break;
                         }
-                        std::string::size_type i = packStart;
-                        while(i < rv.length() && isspace(rv[i]))
-                        {
-                            i++;
-                        }
-                        rv.erase(packStart, i - packStart);
-                        i = rv.length() - 1;
-                        while(i > packStart && isspace(rv[i]))
-                        {
-                            i--;
-                        }
-                        if(!isspace(rv[i]))
-                        {
-                            i++;
-                        }
-                        if(i > packStart)
-                        {
-                            rv.erase(i);
-                        }
-                        for(i = packStart; i < rv.length(); i++)
-                        {
-                            if(rv[i] == 0x0a || rv[i] == 0x0d || rv[i] == 0x09)
-                            {
-                                rv[i] = ' ';
-                            }
-                        }
-                        i = packStart;
-                        while((i = rv.find(' ', i)) != std::string::npos)
-                        {
-                            while(i < rv.length() - 1 && rv[i + 1] == ' ')
-                            {
-                                rv.erase(i, 1);
-                            }
-                            i++;
-                        }
+                        pack(packBuf, 0);
+                        out.write(packBuf);
+                        packBuf.clear();
                         break;
                     }
                     case opError:
@@ -313,127 +711,28 @@ public:
         }
         catch(std::exception& e)
         {
+            if(prof)
+            {
+                prof->leave();
+            }
             ds.dumpContext();
             std::string msg = "Exception during code generation:'";
             msg += e.what();
             msg += "'";
             throw TemplateParsingException(msg, files[ops[idx].fidx], ops[idx].line, ops[idx].col);
         }
-        return rv;
-    }
-
-protected:
-    enum OpCode {
-        opText,
-        opVar,
-        opLoop,
-        opIf,
-        opIfdef,
-        opIfndef,
-        opJump,
-        opSelect,
-        opPack,
-        opPackEnd,
-        opSetBool,
-        opSetVar,
-        opError,
-        opEnd
-    };
-    enum VarFlags {
-        varFlagNone,
-        varFlagUc,
-        varFlagUcf,
-        varFlagHex
-    };
-    typedef std::map<std::string, int> SelectMap;
-
-    enum BoolOp {
-        bopNone,
-        bopVar,
-        bopNotVar,
-        bopNot,
-        bopEqVal,
-        bopNeqVal,
-        bopEqVar,
-        bopNeqVar,
-        bopAnd,
-        bopOr
-    };
-
-    struct BoolTree {
-        BoolOp bop;
-        std::string varName;
-        std::string value;
-        std::unique_ptr<BoolTree> left, right;
-
-        BoolTree() : bop(bopNone)
-        {
-        }
-
-        BoolTree(const BoolTree& other) : bop(other.bop), varName(other.varName), value(other.value)
+        if(packCnt)
         {
-            if(other.left)
-            {
-                left = std::make_unique<BoolTree>(*other.left);
-            }
-            if(other.right)
-            {
-                right = std::make_unique<BoolTree>(*other.right);
-            }
+            out.write(packBuf);
         }
-
-        BoolTree(BoolTree&&) = default;
-
-        template<class DataSource>
-        bool eval(DataSource& ds)
+        if(prof)
         {
-            switch(bop)
-            {
-                case bopAnd:
-                    return left->eval(ds) && right->eval(ds);
-                case bopOr:
-                    return left->eval(ds) || right->eval(ds);
-                case bopVar:
-                    return ds.getBool(varName);
-                case bopNotVar:
-                    return !ds.getBool(varName);
-                case bopEqVal:
-                    //fprintf(stderr,"eqval:%s==%s\n",varName.c_str(),value.c_str());
-                    return ds.getVar(varName) == value;
-                case bopNeqVal:
-                    return ds.getVar(varName) != value;
-                case bopEqVar:
-                    //fprintf(stderr,"eqvar:%s==%s\n",varName.c_str(),value.c_str());
-                    return ds.getVar(varName) == ds.getVar(value);
-                case bopNeqVar:
-                    return ds.getVar(varName) != ds.getVar(value);
-                case bopNot:
-                    return !left->eval(ds);
-                default:
-                    throw std::runtime_error("invalid bool op!");
-            }
+            prof->leave();
         }
-    };
-
-    struct Op;
-    typedef std::vector<Op> OpVector;
-
-    struct Op {
-
-        OpCode op = opEnd;
-        std::string value;
-        OpVector varValue;
-        BoolTree boolValue;
-        int jidx = -1;
-        int line = 0;
-        int col = 0;
-        int fidx = 0;
-        VarFlags varFlag = varFlagNone;
-        bool boolSetValue = false;
-        SelectMap smap;
-    };
+    }
 
     OpVector ops;
+    size_t parsedOps = 0;
     IFileFinder* ff = nullptr;
     StrVector files;
     struct MacroInfo {
@@ -445,6 +744,29 @@ protected:
 
     void Parse(FileReader& fr);
 
+    void dump(const OpVector& ops) const;
+
+    static void pack(std::string& str, std::string::size_type start);
+
+    static void bindSymbols(OpVector& ops);
+
+    int foldConstants(OpVector& ops, const Constants& consts) const;
+    int foldBool(const BoolCode& code, const Constants& consts) const;
+
+    //peephole optimization, semantics of ops and positions of errors are kept
+    static void optimize(OpVector& ops);
+    static void threadJumps(OpVector& ops);
+    static void removeDeadOps(OpVector& ops);
+    static void mergeText(OpVector& ops);
+    static void removeOps(OpVector& ops, const std::vector<bool>& keep);
+    static size_t countOps(const OpVector& ops);
+
+    //string values compared in $if$ expressions
+    StrVector boolLiterals;
+
+    void compileBool(const BoolTree& bt, BoolCode& code);
+    static void threadBoolJumps(BoolCode& code);
+
     std::string
     expandMacro(const MacroInfo& mi, const std::vector<std::string>& args, const std::string& fileName, int line,
                 int col);
@@ -0,0 +1,453 @@
+#include <algorithm>
+#include <map>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include "Template.hpp"
+
+namespace protogen {
+
+namespace {
+
+//C++ string literal, octal escapes can't consume following characters unlike hex ones
+std::string cppString(const std::string& str)
+{
+    //long texts are split into literals line by line
+    static const char lineBreak[] = "\"\n        \"";
+    std::string rv = "\"";
+    for(char c : str)
+    {
+        unsigned char uc = static_cast<unsigned char>(c);
+        if(c == '"' || c == '\\' || c == '?')
+        {
+            rv += '\\';
+            rv += c;
+        }
+        else if(c == '\n')
+        {
+            rv += "\\n";
+            rv += lineBreak;
+        }
+        else if(uc < 0x20 || uc >= 0x7f)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\%03o", uc);
+            rv += buf;
+        }
+        else
+        {
+            rv += c;
+        }
+    }
+    if(!str.empty() && str.back() == '\n')
+    {
+        //no empty continuation after last line
+        rv.resize(rv.length() - strlen(lineBreak));
+    }
+    rv += '"';
+    return rv;
+}
+
+std::string str(int value)
+{
+    return std::to_string(value);
+}
+
+}
+
+uint64_t Template::sourceHash() const
+{
+    uint64_t rv = hashString(std::to_string(compiledTemplateAbi));
+    for(auto& file : files)
+    {
+        //expanded macros are stored as file::macro, their text comes from real files
+        if(file.find("::") != std::string::npos)
+        {
+            continue;
+        }
+        FileReader fr;
+        fr.Open(file);
+        rv = hashMix(rv + hashData(fr.data, fr.fileSize));
+    }
+    return rv;
+}
+
+bool Template::attachCompiled(const CompiledTemplateInfo* info)
+{
+    if(info->abi != compiledTemplateAbi || info->sourceHash != sourceHash())
+    {
+        return false;
+    }
+    compiledSyms.clear();
+    for(int i = 0; i < info->symbolsCount; i++)
+    {
+        compiledSyms.push_back(SymbolTable::lookupId(info->symbols[i]));
+    }
+    compiled = info;
+    return true;
+}
+
+/*
+ * Every op becomes a statement with label if something jumps to it,
+ * jumps become gotos. Same variables as in interpreter are kept: pack
+ * buffer, pack depth and index of current op for error reporting.
+ */
+std::string Template::compile() const
+{
+    std::map<SymbolId, int> symIdx;
+    StrVector symNames;
+    auto sym = [&symIdx, &symNames](SymbolId id)
+    {
+        auto it = symIdx.find(id);
+        if(it == symIdx.end())
+        {
+            it = symIdx.emplace(id, static_cast<int>(symNames.size())).first;
+            symNames.push_back(SymbolTable::name(SymbolTable::absolute(id)));
+        }
+        return "sym[" + str(it->second) + "]";
+    };
+    auto position = [](const Op& op)
+    {
+        return "{" + str(op.fidx) + ", " + str(op.line) + ", " + str(op.col) + "}";
+    };
+    auto varValue = [&sym](const Op& op)
+    {
+        std::string value = "ctx.getVar(" + sym(op.sym) + ")";
+        switch(op.varFlag)
+        {
+            case varFlagUcf:
+                return "compiled::ucFirst(" + value + ")";
+            case varFlagUc:
+                return "compiled::upperCase(" + value + ")";
+            case varFlagHex:
+                return "compiled::hexValue(" + value + ")";
+            default:
+                return value;
+        }
+    };
+
+    std::string globals;
+    std::string body;
+    std::string positions;
+
+    std::set<int> targets;
+    for(size_t i = 0; i < ops.size(); i++)
+    {
+        const Op& op = ops[i];
+        switch(op.op)
+        {
+            case opLoop:
+            case opIf:
+            case opIfdef:
+            case opIfndef:
+            case opJump:
+                targets.insert(op.jidx);
+                break;
+            case opSelect:
+                for(auto& slot : op.select.slots)
+                {
+                    if(slot.target != -1)
+                    {
+                        targets.insert(slot.target);
+                    }
+                }
+                if(op.select.defaultTarget != -1)
+                {
+                    targets.insert(op.select.defaultTarget);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    for(size_t l = 0; l < boolLiterals.size(); l++)
+    {
+        globals += "const std::string lit" + str(l) + "(" + cppString(boolLiterals[l]) + ", " +
+                   str(boolLiterals[l].length()) + ");\n";
+    }
+
+    for(size_t i = 0; i < ops.size(); i++)
+    {
+        const Op& op = ops[i];
+        std::string idx = str(static_cast<int>(i));
+        positions += "    " + position(op) + ",\n";
+        if(targets.count(static_cast<int>(i)))
+        {
+            body += "    L" + idx + ":\n";
+        }
+        if(op.op != opText && op.op != opEnd)
+        {
+            body += "        op = " + idx + ";\n";
+        }
+        switch(op.op)
+        {
+            case opText:
+                globals += "const char text" + idx + "[] = " + cppString(op.value) + ";\n";
+                body += "        putText(text" + idx + ", sizeof(text" + idx + ") - 1);\n";
+                break;
+            case opVar:
+                body += "        put(" + varValue(op) + ");\n";
+                break;
+            case opSetBool:
+                body += "        ctx.setBool(" + sym(op.sym) + ", " + (op.boolSetValue ? "true" : "false") + ");\n";
+                break;
+            case opSetVar:
+            {
+                std::string valuePositions;
+                body += "        {\n";
+                body += "            std::string value;\n";
+                body += "            int vop = 0;\n";
+                body += "            try\n";
+                body += "            {\n";
+                for(size_t v = 0; v < op.varValue.size() && op.varValue[v].op != opEnd; v++)
+                {
+                    const Op& vop = op.varValue[v];
+                    valuePositions += "        " + position(vop) + ",\n";
+                    body += "                vop = " + str(static_cast<int>(v)) + ";\n";
+                    if(vop.op == opText)
+                    {
+                        body += "                value.append(" + cppString(vop.value) + ", " +
+                                str(vop.value.length()) + ");\n";
+                    }
+                    else
+                    {
+                        body += "                value += " + varValue(vop) + ";\n";
+                    }
+                }
+                body += "            }\n";
+                body += "            catch(std::exception& e)\n";
+                body += "            {\n";
+                body += "                static const int valuePositions[][3] = {\n" + valuePositions + "                {0, 0, 0}};\n";
+                body += "                ctx.fail(e.what(), valuePositions[vop][0], valuePositions[vop][1], valuePositions[vop][2]);\n";
+                body += "            }\n";
+                body += "            ctx.setVar(" + sym(op.sym) + ", value);\n";
+                body += "        }\n";
+                break;
+            }
+            case opLoop:
+                body += "        if(!ctx.loopNext(" + sym(op.sym) + "))\n";
+                body += "        {\n";
+                body += "            goto L" + str(op.jidx) + ";\n";
+                body += "        }\n";
+                break;
+            case opIf:
+            {
+                const int size = static_cast<int>(op.boolCode.size());
+                std::set<int> boolTargets;
+                for(auto& bi : op.boolCode)
+                {
+                    if(bi.bop == bopJumpIfFalse || bi.bop == bopJumpIfTrue)
+                    {
+                        boolTargets.insert(bi.arg);
+                    }
+                }
+                for(int pc = 0; pc <= size; pc++)
+                {
+                    if(boolTargets.count(pc))
+                    {
+                        body += "    L" + idx + "_" + str(pc) + ":\n";
+                    }
+                    if(pc == size)
+                    {
+                        break;
+                    }
+                    const BoolInstr& bi = op.boolCode[pc];
+                    switch(bi.bop)
+                    {
+                        case bopVar:
+                            body += "        acc = ctx.getBool(" + sym(bi.sym) + ");\n";
+                            break;
+                        case bopNotVar:
+                            body += "        acc = !ctx.getBool(" + sym(bi.sym) + ");\n";
+                            break;
+                        case bopEqVal:
+                            body += "        acc = ctx.getVar(" + sym(bi.sym) + ") == lit" + str(bi.arg) + ";\n";
+                            break;
+                        case bopNeqVal:
+                            body += "        acc = ctx.getVar(" + sym(bi.sym) + ") != lit" + str(bi.arg) + ";\n";
+                            break;
+                        case bopEqVar:
+                            body += "        acc = ctx.getVar(" + sym(bi.sym) + ") == ctx.getVar(" + sym(bi.arg) + ");\n";
+                            break;
+                        case bopNeqVar:
+                            body += "        acc = ctx.getVar(" + sym(bi.sym) + ") != ctx.getVar(" + sym(bi.arg) + ");\n";
+                            break;
+                        case bopNot:
+                            body += "        acc = !acc;\n";
+                            break;
+                        case bopJumpIfFalse:
+                            body += "        if(!acc)\n";
+                            body += "        {\n";
+                            body += "            goto L" + idx + "_" + str(bi.arg) + ";\n";
+                            body += "        }\n";
+                            break;
+                        case bopJumpIfTrue:
+                            body += "        if(acc)\n";
+                            body += "        {\n";
+                            body += "            goto L" + idx + "_" + str(bi.arg) + ";\n";
+                            body += "        }\n";
+                            break;
+                        default:
+                            body += "        throw std::runtime_error(\"invalid bool op!\");\n";
+                            break;
+                    }
+                }
+                body += "        if(!acc)\n";
+                body += "        {\n";
+                body += "            goto L" + str(op.jidx) + ";\n";
+                body += "        }\n";
+                break;
+            }
+            case opIfdef:
+            case opIfndef:
+                body += std::string("        if(") + (op.op == opIfdef ? "!" : "") + "ctx.haveVar(" + sym(op.sym) + "))\n";
+                body += "        {\n";
+                body += "            goto L" + str(op.jidx) + ";\n";
+                body += "        }\n";
+                break;
+            case opJump:
+                body += "        goto L" + str(op.jidx) + ";\n";
+                break;
+            case opSelect:
+            {
+                std::string table = "select" + idx;
+                globals += "const std::unordered_map<std::string, int> " + table + " = {\n";
+                std::string cases;
+                int caseIdx = 0;
+                for(auto& slot : op.select.slots)
+                {
+                    if(slot.target == -1)
+                    {
+                        continue;
+                    }
+                    globals += "    {std::string(" + cppString(slot.value) + ", " + str(slot.value.length()) + "), " +
+                               str(caseIdx) + "},\n";
+                    cases += "                case " + str(caseIdx) + ":\n";
+                    cases += "                    goto L" + str(slot.target) + ";\n";
+                    caseIdx++;
+                }
+                globals += "};\n";
+                body += "        {\n";
+                body += "            const std::string& value = ctx.getVar(" + sym(op.sym) + ");\n";
+                body += "            auto it = " + table + ".find(value);\n";
+                body += "            switch(it == " + table + ".end() ? -1 : it->second)\n";
+                body += "            {\n";
+                body += cases;
+                body += "                default:\n";
+                if(op.select.defaultTarget != -1)
+                {
+                    body += "                    goto L" + str(op.select.defaultTarget) + ";\n";
+                }
+                else
+                {
+                    body += "                    throw std::runtime_error(\"Case '\" + value + \"' not found for variable '\" + " +
+                            cppString(op.value) + " + \"'\");\n";
+                }
+                body += "            }\n";
+                body += "        }\n";
+                break;
+            }
+            case opPack:
+                body += "        packCnt++;\n";
+                break;
+            case opPackEnd:
+                body += "        packCnt--;\n";
+                body += "        if(packCnt == 0)\n";
+                body += "        {\n";
+                body += "            ctx.pack(packBuf);\n";
+                body += "            out.write(packBuf);\n";
+                body += "            packBuf.clear();\n";
+                body += "        }\n";
+                break;
+            case opError:
+                body += "        throw std::runtime_error(" + cppString(op.value) + ");\n";
+                break;
+            case opEnd:
+                body += "        ;\n";
+                break;
+        }
+        if(op.op == opEnd)
+        {
+            break;
+        }
+    }
+
+    std::string symbols;
+    for(auto& name : symNames)
+    {
+        symbols += "    " + cppString(name) + ",\n";
+    }
+
+    char hash[32];
+    snprintf(hash, sizeof(hash), "0x%016llxULL", static_cast<unsigned long long>(sourceHash()));
+
+    std::string rv;
+    rv += "//Generated by protogen --compileTemplate from " + files.front() + "\n";
+    rv += "//Build as shared object with protogen sources in include path.\n";
+    rv += "#include <stdexcept>\n";
+    rv += "#include <unordered_map>\n";
+    rv += "#include \"CompiledTemplate.hpp\"\n\n";
+    rv += "using namespace protogen;\n\n";
+    rv += "namespace {\n\n";
+    rv += globals;
+    rv += "\nconst char* const symbols[] = {\n" + symbols + "    nullptr\n};\n\n";
+    rv += "const int positions[][3] = {\n" + positions + "};\n\n";
+    rv += "void render(ITemplateContext& ctx, const SymbolId* sym, IOutputSink& out)\n";
+    rv += "{\n";
+    rv += "    std::string packBuf;\n";
+    rv += "    int packCnt = 0;\n";
+    rv += "    int op = 0;\n";
+    rv += "    bool acc = false;\n";
+    rv += "    auto putText = [&out, &packBuf, &packCnt](const char* data, size_t size)\n";
+    rv += "    {\n";
+    rv += "        if(packCnt)\n";
+    rv += "        {\n";
+    rv += "            packBuf.append(data, size);\n";
+    rv += "        }\n";
+    rv += "        else\n";
+    rv += "        {\n";
+    rv += "            out.write(data, size);\n";
+    rv += "        }\n";
+    rv += "    };\n";
+    rv += "    auto put = [&putText](const std::string& str)\n";
+    rv += "    {\n";
+    rv += "        putText(str.data(), str.length());\n";
+    rv += "    };\n";
+    rv += "    (void)sym;\n";
+    rv += "    (void)acc;\n";
+    rv += "    (void)put;\n";
+    rv += "    try\n";
+    rv += "    {\n";
+    rv += body;
+    rv += "    }\n";
+    rv += "    catch(std::exception& e)\n";
+    rv += "    {\n";
+    rv += "        ctx.fail(e.what(), positions[op][0], positions[op][1], positions[op][2]);\n";
+    rv += "    }\n";
+    rv += "    if(packCnt)\n";
+    rv += "    {\n";
+    rv += "        out.write(packBuf);\n";
+    rv += "    }\n";
+    rv += "}\n\n";
+    rv += "const CompiledTemplateInfo info = {\n";
+    rv += "    compiledTemplateAbi,\n";
+    rv += "    " + cppString(files.front()) + ",\n";
+    rv += "    " + std::string(hash) + ",\n";
+    rv += "    " + str(static_cast<int>(symNames.size())) + ",\n";
+    rv += "    symbols,\n";
+    rv += "    render\n";
+    rv += "};\n\n";
+    rv += "}\n\n";
+    rv += "extern \"C\"\n";
+    rv += "#ifdef _WIN32\n";
+    rv += "__declspec(dllexport)\n";
+    rv += "#endif\n";
+    rv += "const CompiledTemplateInfo* " PROTOGEN_COMPILED_TEMPLATE_FUNC "()\n";
+    rv += "{\n";
+    rv += "    return &info;\n";
+    rv += "}\n";
+    return rv;
+}
+
+} // namespace protogen
@@ -3,9 +3,46 @@
 //
 
 #include "TemplateDataSource.hpp"
+#include "ModelWriter.hpp"
 
 namespace protogen {
 
+namespace {
+
+//parts of other definitions fillFields reads for fields
+void writeFieldsInputs(protogen::Parser& p, ModelWriter& mw, const protogen::FieldsVector& fields)
+{
+    mw.write(fields);
+    for(const auto& f : fields)
+    {
+        if(f.ft.fk == FieldKind::Nested)
+        {
+            mw.write(p.getMessage(f.ft.typeName).pkg);
+        }
+        else if(f.ft.fk == FieldKind::Enum)
+        {
+            const Enum& e = p.getEnum(f.ft.typeName);
+            mw.write(e.typeName);
+            mw.write(e.pkg);
+        }
+        else if(f.ft.fk == FieldKind::Type)
+        {
+            mw.write(p.getType(f.ft.typeName));
+        }
+        if(!f.fsname.empty())
+        {
+            mw.write(p.getFieldset(f.fsname).pkg);
+        }
+    }
+}
+
+uint64_t writerHash(const ModelWriter& mw)
+{
+    return hashData(mw.buf.data(), mw.buf.size());
+}
+
+}
+
 void TemplateDataSource::initForMessage(protogen::Parser& p, const std::string& messageName)
 {
     using namespace protogen;
@@ -35,22 +72,24 @@ void TemplateDataSource::initForMessage(protogen::Parser& p, const std::string&
     }
 
 
-    Loop& msgFields = createLoop("field");
-    fillFields(p, msgFields, msg.fields);
-    {
-        const Message* pmsg = msg.parent.empty() ? nullptr : &p.getMessage(msg.parent);
-        Loop& msgParentFields = createLoop("parent.field");
-        msgParentFields.name = "field";
-        while(pmsg)
+    const Message* pmsg = &msg;
+    createLoop("field").populate = [&p, pmsg](Loop& ld) {
+        fillFields(p, ld, pmsg->fields);
+    };
+    Loop& msgParentFields = createLoop("parent.field");
+    msgParentFields.setName("field");
+    msgParentFields.populate = [&p, pmsg](Loop& ld) {
+        const Message* parent = pmsg;
+        while(!parent->parent.empty())
         {
-            fillFields(p, msgParentFields, pmsg->fields);
-            pmsg = pmsg->parent.empty() ? nullptr : &p.getMessage(pmsg->parent);
+            parent = &p.getMessage(parent->parent);
+            fillFields(p, ld, parent->fields);
         }
-    }
+    };
 
     for(const auto& prop : msg.properties)
     {
-        for(const auto& field : prop.fields)
+        prop.forEachField([&](const PropertyField& field)
         {
             std::string n = "message.";
             n += field.name;
@@ -66,7 +105,7 @@ void TemplateDataSource::initForMessage(protogen::Parser& p, const std::string&
             {
                 setVar(n, std::to_string(field.intValue));
             }
-        }
+        });
     }
 
 }
@@ -77,8 +116,14 @@ void TemplateDataSource::initForProtocol(const protogen::Parser& p, const std::s
     const Protocol& proto = p.getProtocol(protoName);
     setVar("protocol.name", protoName);
     fillPackage("protocol.package", proto.pkg);
-    typedef protogen::Protocol::MessagesVector MsgVector;
-    Loop& ld = createLoop("message");
+    createLoop("message").populate = [&p, &proto](Loop& ld) {
+        fillMessages(p, ld, proto);
+    };
+}
+
+void TemplateDataSource::fillMessages(const protogen::Parser& p, Loop& ld, const protogen::Protocol& proto)
+{
+    using namespace protogen;
     for(const auto& message : proto.messages)
     {
         const Message& msg = p.getMessage(message.msgName);
@@ -97,7 +142,7 @@ void TemplateDataSource::initForProtocol(const protogen::Parser& p, const std::s
         }
         for(const auto& prop : msg.properties)
         {
-            for(const auto& field : prop.fields)
+            prop.forEachField([&](const PropertyField& field)
             {
                 if(field.pt == ptBool)
                 {
@@ -111,11 +156,11 @@ void TemplateDataSource::initForProtocol(const protogen::Parser& p, const std::s
                 {
                     mn.addVar("message." + field.name, std::to_string(field.intValue));
                 }
-            }
+            });
         }
         for(const auto& prop : message.props)
         {
-            for(const auto& field : prop.fields)
+            prop.forEachField([&](const PropertyField& field)
             {
                 if(field.pt == ptBool)
                 {
@@ -129,7 +174,7 @@ void TemplateDataSource::initForProtocol(const protogen::Parser& p, const std::s
                 {
                     mn.addVar("message." + field.name, std::to_string(field.intValue));
                 }
-            }
+            });
         }
     }
 }
@@ -140,24 +185,13 @@ void TemplateDataSource::initForEnum(protogen::Parser& p, const std::string& enu
     const Enum& e = p.getEnum(enumName);
     setVar("enum.name", e.name);
     setVar("enum.type", e.typeName);
-    Loop& ld = createLoop("item");
-    for(auto& val : e.values)
-    {
-        Namespace& en = ld.newItem();
-        en.addVar("item.name", val.name);
-        if(e.vt == Enum::vtString)
-        {
-            en.addVar("item.value", val.strVal);
-        }
-        else
-        {
-            en.addVar("item.value", std::to_string(val.intVal));
-        }
-    }
+    createLoop("item").populate = [&e](Loop& ld) {
+        fillEnumItems(ld, e);
+    };
 
     for(const auto& prop : e.properties)
     {
-        for(const auto& field : prop.fields)
+        prop.forEachField([&](const PropertyField& field)
         {
             std::string n = "enum." + field.name;
             if(field.pt == ptBool)
@@ -172,6 +206,24 @@ void TemplateDataSource::initForEnum(protogen::Parser& p, const std::string& enu
             {
                 setVar(n, std::to_string(field.intValue));
             }
+        });
+    }
+}
+
+void TemplateDataSource::fillEnumItems(Loop& ld, const protogen::Enum& e)
+{
+    using namespace protogen;
+    for(auto& val : e.values)
+    {
+        Namespace& en = ld.newItem();
+        en.addVar("item.name", val.name);
+        if(e.vt == Enum::vtString)
+        {
+            en.addVar("item.value", val.strVal);
+        }
+        else
+        {
+            en.addVar("item.value", std::to_string(val.intVal));
         }
     }
 }
@@ -216,7 +268,7 @@ void TemplateDataSource::fillFields(protogen::Parser& p, Loop& ld, const protoge
 
             for(const auto& prop : typeDef.properties)
             {
-                for(const auto& field : prop.fields)
+                prop.forEachField([&](const PropertyField& field)
                 {
                     auto name = fn.parentName + ".type." + field.name;
                     if(field.pt == ptBool)
@@ -231,7 +283,7 @@ void TemplateDataSource::fillFields(protogen::Parser& p, Loop& ld, const protoge
                     {
                         fn.addVar(name, field.strValue);
                     }
-                }
+                });
             }
             for(auto& gen:ft.genericParamsValues)
             {
@@ -262,7 +314,7 @@ void TemplateDataSource::fillFields(protogen::Parser& p, Loop& ld, const protoge
         }
         for(const auto& prop2 : it->properties)
         {
-            for(const auto& field : prop2.fields)
+            prop2.forEachField([&](const PropertyField& field)
             {
                 if(field.pt == ptString)
                 {
@@ -276,9 +328,57 @@ void TemplateDataSource::fillFields(protogen::Parser& p, Loop& ld, const protoge
                 {
                     fn.addVar(field.name, std::to_string(field.intValue));
                 }
-            }
+            });
         }
     }
 }
 
+uint64_t TemplateDataSource::inputsHashForMessage(protogen::Parser& p, const std::string& messageName)
+{
+    ModelWriter mw;
+    const Message& msg = p.getMessage(messageName);
+    mw.write(msg);
+    writeFieldsInputs(p, mw, msg.fields);
+    const Message* parent = &msg;
+    while(!parent->parent.empty())
+    {
+        parent = &p.getMessage(parent->parent);
+        mw.write(parent->pkg);
+        writeFieldsInputs(p, mw, parent->fields);
+    }
+    return writerHash(mw);
+}
+
+uint64_t TemplateDataSource::inputsHashForProtocol(protogen::Parser& p, const std::string& protoName)
+{
+    ModelWriter mw;
+    const Protocol& proto = p.getProtocol(protoName);
+    mw.write(proto);
+    for(const auto& message : proto.messages)
+    {
+        const Message& msg = p.getMessage(message.msgName);
+        mw.write(msg.name);
+        mw.write(msg.haveTag);
+        mw.write(msg.tag);
+        mw.write(msg.parent);
+        mw.write(msg.properties);
+    }
+    return writerHash(mw);
+}
+
+uint64_t TemplateDataSource::inputsHashForEnum(protogen::Parser& p, const std::string& enumName)
+{
+    ModelWriter mw;
+    mw.write(p.getEnum(enumName));
+    return writerHash(mw);
+}
+
+uint64_t TemplateDataSource::inputsHashForFieldSet(protogen::Parser& p, const protogen::FieldSet& fs)
+{
+    ModelWriter mw;
+    mw.write(fs);
+    writeFieldsInputs(p, mw, fs.fields);
+    return writerHash(mw);
+}
+
 } // namespace protogen
@@ -30,7 +30,10 @@ struct TemplateDataSource : protogen::DataSource {
     {
         setVar("fieldset.name", fs.name);
         fillPackage("fieldset.package", fs.pkg);
-        fillFields(p, createLoop("field"), fs.fields);
+        const FieldsVector* fields = &fs.fields;
+        createLoop("field").populate = [&p, fields](Loop& ld) {
+            fillFields(p, ld, *fields);
+        };
     }
 
 
@@ -38,14 +41,35 @@ struct TemplateDataSource : protogen::DataSource {
 
     void initForEnum(protogen::Parser& p, const std::string& enumName);
 
-    void fillFields(protogen::Parser& p, Loop& ld, const protogen::FieldsVector& fields);
+    static void fillFields(protogen::Parser& p, Loop& ld, const protogen::FieldsVector& fields);
+
+    static void fillMessages(const protogen::Parser& p, Loop& ld, const protogen::Protocol& proto);
+
+    static void fillEnumItems(Loop& ld, const protogen::Enum& e);
+
+    /*
+     * Hash of all definitions initForX reads for the entity,
+     * if it is unchanged, generated files are the same.
+     */
+    static uint64_t inputsHashForMessage(protogen::Parser& p, const std::string& messageName);
+    static uint64_t inputsHashForProtocol(protogen::Parser& p, const std::string& protoName);
+    static uint64_t inputsHashForEnum(protogen::Parser& p, const std::string& enumName);
+    static uint64_t inputsHashForFieldSet(protogen::Parser& p, const protogen::FieldSet& fs);
 
     void dumpContext()
     {
         printf("Current context vars dump:\n");
-        for(auto& var : top->vars)
+        std::map<std::string, const std::string*> vars;
+        for(size_t id = 0; id < top->varSlots.size(); id++)
+        {
+            if(top->varSlots[id] >= 0)
+            {
+                vars[SymbolTable::name(static_cast<SymbolId>(id))] = &top->values[top->varSlots[id]];
+            }
+        }
+        for(auto& var : vars)
         {
-            printf("%s='%s'\n", var.first.c_str(), var.second.c_str());
+            printf("%s='%s'\n", var.first.c_str(), var.second->c_str());
         }
     }
 };
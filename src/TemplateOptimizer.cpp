@@ -0,0 +1,423 @@
+#include <set>
+#include "Template.hpp"
+
+namespace protogen {
+
+void Template::getAssignedSymbols(std::set<SymbolId>& syms) const
+{
+    for(auto& op : ops)
+    {
+        if(op.op == opSetVar || op.op == opSetBool)
+        {
+            syms.insert(SymbolTable::absolute(op.sym));
+        }
+    }
+}
+
+int Template::specialize(const Constants& consts)
+{
+    int rv = foldConstants(ops, consts);
+    if(rv)
+    {
+        optimize(ops);
+    }
+    return rv;
+}
+
+int Template::foldConstants(OpVector& ops, const Constants& consts) const
+{
+    int rv = 0;
+    //folded condition becomes jump to one of its branches
+    auto makeJump = [&rv](Op& op, int target)
+    {
+        op.op = opJump;
+        op.jidx = target;
+        op.boolCode.clear();
+        op.select = SelectTable();
+        rv++;
+    };
+    for(size_t idx = 0; idx < ops.size(); idx++)
+    {
+        Op& op = ops[idx];
+        const int next = static_cast<int>(idx + 1);
+        switch(op.op)
+        {
+            case opVar:
+            {
+                const std::string* val = consts.findVar(op.sym);
+                if(!val)
+                {
+                    break;
+                }
+                switch(op.varFlag)
+                {
+                    case varFlagUc:
+                        op.value = compiled::upperCase(*val);
+                        break;
+                    case varFlagUcf:
+                        op.value = compiled::ucFirst(*val);
+                        break;
+                    case varFlagHex:
+                        op.value = compiled::hexValue(*val);
+                        break;
+                    default:
+                        op.value = *val;
+                        break;
+                }
+                op.op = opText;
+                op.varFlag = varFlagNone;
+                rv++;
+                break;
+            }
+            case opIf:
+            {
+                int val = foldBool(op.boolCode, consts);
+                if(val >= 0)
+                {
+                    makeJump(op, val ? next : op.jidx);
+                }
+                break;
+            }
+            case opIfdef:
+            case opIfndef:
+            {
+                int def = consts.isDefined(op.sym);
+                if(def >= 0)
+                {
+                    makeJump(op, (def == 1) == (op.op == opIfdef) ? next : op.jidx);
+                }
+                break;
+            }
+            case opSelect:
+            {
+                const std::string* val = consts.findVar(op.sym);
+                if(!val)
+                {
+                    break;
+                }
+                int target = op.select.find(*val);
+                if(target == -1)
+                {
+                    target = op.select.defaultTarget;
+                }
+                //missing case is reported on render
+                if(target != -1)
+                {
+                    makeJump(op, target);
+                }
+                break;
+            }
+            case opSetVar:
+                //value without variables is merged to single text by optimize
+                rv += foldConstants(op.varValue, consts);
+                break;
+            default:
+                break;
+        }
+    }
+    return rv;
+}
+
+//value of expression if its evaluation reads only constants, -1 otherwise
+int Template::foldBool(const BoolCode& code, const Constants& consts) const
+{
+    int acc = 0;
+    const int size = static_cast<int>(code.size());
+    for(int pc = 0; pc < size;)
+    {
+        const BoolInstr& bi = code[pc++];
+        switch(bi.bop)
+        {
+            case bopVar:
+            case bopNotVar:
+                acc = consts.findBool(bi.sym);
+                if(acc >= 0 && bi.bop == bopNotVar)
+                {
+                    acc = !acc;
+                }
+                break;
+            case bopEqVal:
+            case bopNeqVal:
+            {
+                const std::string* val = consts.findVar(bi.sym);
+                if(!val)
+                {
+                    return -1;
+                }
+                acc = (*val == boolLiterals[bi.arg]) == (bi.bop == bopEqVal);
+                break;
+            }
+            case bopEqVar:
+            case bopNeqVar:
+            {
+                const std::string* val = consts.findVar(bi.sym);
+                const std::string* other = consts.findVar(bi.arg);
+                if(!val || !other)
+                {
+                    return -1;
+                }
+                acc = (*val == *other) == (bi.bop == bopEqVar);
+                break;
+            }
+            case bopNot:
+                acc = !acc;
+                break;
+            case bopJumpIfFalse:
+                if(!acc)
+                {
+                    pc = bi.arg;
+                }
+                break;
+            case bopJumpIfTrue:
+                if(acc)
+                {
+                    pc = bi.arg;
+                }
+                break;
+            default:
+                return -1;
+        }
+        if(acc < 0)
+        {
+            return -1;
+        }
+    }
+    return acc;
+}
+
+void Template::optimize(OpVector& ops)
+{
+    for(auto& op : ops)
+    {
+        if(op.op == opSetVar)
+        {
+            optimize(op.varValue);
+        }
+    }
+    //removed ops can make new chains of jumps and adjacent texts
+    for(;;)
+    {
+        size_t size = ops.size();
+        threadJumps(ops);
+        removeDeadOps(ops);
+        mergeText(ops);
+        if(ops.size() == size)
+        {
+            break;
+        }
+    }
+}
+
+//jump to unconditional jump goes directly to its target
+void Template::threadJumps(OpVector& ops)
+{
+    const int size = static_cast<int>(ops.size());
+    auto follow = [&ops, size](int target)
+    {
+        //loop made only of jumps can't come from parser, but stay finite anyway
+        for(int steps = 0; steps < size && ops[target].op == opJump; steps++)
+        {
+            target = ops[target].jidx;
+        }
+        return target;
+    };
+    for(auto& op : ops)
+    {
+        if(op.jidx != -1)
+        {
+            op.jidx = follow(op.jidx);
+        }
+        for(auto& slot : op.select.slots)
+        {
+            if(slot.target != -1)
+            {
+                slot.target = follow(slot.target);
+            }
+        }
+        if(op.select.defaultTarget != -1)
+        {
+            op.select.defaultTarget = follow(op.select.defaultTarget);
+        }
+    }
+}
+
+/*
+ * Removes ops that can't be reached from the first one and ops that do nothing:
+ * empty text, jumps to next op and $ifdef$ with empty body.
+ * Empty $if$ is kept, evaluation of its expression can fail.
+ * Last op (opEnd) is always kept.
+ */
+void Template::removeDeadOps(OpVector& ops)
+{
+    const int size = static_cast<int>(ops.size());
+    std::vector<bool> keep(size, false);
+    std::vector<int> pending;
+    auto reach = [&keep, &pending](int idx)
+    {
+        if(!keep[idx])
+        {
+            keep[idx] = true;
+            pending.push_back(idx);
+        }
+    };
+    reach(0);
+    while(!pending.empty())
+    {
+        int idx = pending.back();
+        pending.pop_back();
+        const Op& op = ops[idx];
+        switch(op.op)
+        {
+            case opJump:
+                reach(op.jidx);
+                break;
+            case opLoop:
+            case opIf:
+            case opIfdef:
+            case opIfndef:
+                reach(op.jidx);
+                reach(idx + 1);
+                break;
+            case opSelect:
+                for(auto& slot : op.select.slots)
+                {
+                    if(slot.target != -1)
+                    {
+                        reach(slot.target);
+                    }
+                }
+                if(op.select.defaultTarget != -1)
+                {
+                    reach(op.select.defaultTarget);
+                }
+                break;
+            case opError:
+            case opEnd:
+                break;
+            default:
+                reach(idx + 1);
+                break;
+        }
+    }
+    for(int idx = 0; idx < size; idx++)
+    {
+        const Op& op = ops[idx];
+        switch(op.op)
+        {
+            case opText:
+                keep[idx] = keep[idx] && !op.value.empty();
+                break;
+            case opJump:
+            case opIfdef:
+            case opIfndef:
+                keep[idx] = keep[idx] && op.jidx != idx + 1;
+                break;
+            default:
+                break;
+        }
+    }
+    keep[size - 1] = true;
+    removeOps(ops, keep);
+}
+
+//adjacent texts are joined unless something jumps between them
+void Template::mergeText(OpVector& ops)
+{
+    const size_t size = ops.size();
+    std::vector<bool> isTarget(size, false);
+    for(auto& op : ops)
+    {
+        if(op.jidx != -1)
+        {
+            isTarget[op.jidx] = true;
+        }
+        for(auto& slot : op.select.slots)
+        {
+            if(slot.target != -1)
+            {
+                isTarget[slot.target] = true;
+            }
+        }
+        if(op.select.defaultTarget != -1)
+        {
+            isTarget[op.select.defaultTarget] = true;
+        }
+    }
+    std::vector<bool> keep(size, true);
+    size_t text = size;
+    for(size_t idx = 0; idx < size; idx++)
+    {
+        if(ops[idx].op != opText)
+        {
+            text = size;
+            continue;
+        }
+        if(text != size && !isTarget[idx])
+        {
+            ops[text].value += ops[idx].value;
+            keep[idx] = false;
+            continue;
+        }
+        text = idx;
+    }
+    removeOps(ops, keep);
+}
+
+//targets of kept ops are adjusted, jump to removed op goes to the next kept one
+void Template::removeOps(OpVector& ops, const std::vector<bool>& keep)
+{
+    const size_t size = ops.size();
+    std::vector<int> newIdx(size);
+    int cnt = 0;
+    for(size_t idx = 0; idx < size; idx++)
+    {
+        newIdx[idx] = cnt;
+        if(keep[idx])
+        {
+            cnt++;
+        }
+    }
+    if(static_cast<size_t>(cnt) == size)
+    {
+        return;
+    }
+    OpVector rv;
+    rv.reserve(cnt);
+    for(size_t idx = 0; idx < size; idx++)
+    {
+        if(!keep[idx])
+        {
+            continue;
+        }
+        rv.push_back(std::move(ops[idx]));
+        Op& op = rv.back();
+        if(op.jidx != -1)
+        {
+            op.jidx = newIdx[op.jidx];
+        }
+        for(auto& slot : op.select.slots)
+        {
+            if(slot.target != -1)
+            {
+                slot.target = newIdx[slot.target];
+            }
+        }
+        if(op.select.defaultTarget != -1)
+        {
+            op.select.defaultTarget = newIdx[op.select.defaultTarget];
+        }
+    }
+    ops.swap(rv);
+}
+
+size_t Template::countOps(const OpVector& ops)
+{
+    size_t rv = ops.size();
+    for(auto& op : ops)
+    {
+        rv += countOps(op.varValue);
+    }
+    return rv;
+}
+
+} // namespace protogen
@@ -15,4 +15,15 @@ StrVector splitString(const std::string& str, const std::string& div)
     return rv;
 }
 
+uint64_t hashData(const char* data, size_t size, uint64_t seed)
+{
+    uint64_t rv = seed;
+    for(size_t i = 0; i < size; i++)
+    {
+        rv ^= static_cast<unsigned char>(data[i]);
+        rv *= 1099511628211ULL;
+    }
+    return rv;
+}
+
 } // namespace protogen
@@ -2,11 +2,63 @@
 
 #include <string>
 #include <vector>
+#include <stdint.h>
 
 namespace protogen {
 
 using StrVector = std::vector<std::string>;
 
+//non owning reference to a part of a buffer
+struct StrRef {
+    StrRef() = default;
+
+    StrRef(const char* argPtr, size_t argLen) : ptr(argPtr), len(argLen)
+    {
+    }
+
+    const char* ptr = nullptr;
+    size_t len = 0;
+
+    size_t length() const
+    {
+        return len;
+    }
+
+    bool empty() const
+    {
+        return len == 0;
+    }
+
+    std::string str() const
+    {
+        return std::string(ptr, len);
+    }
+
+    operator std::string() const
+    {
+        return str();
+    }
+};
+
 StrVector splitString(const std::string& str, const std::string& div);
 
+//FNV-1a, seed allows to continue hashing of previous data
+uint64_t hashData(const char* data, size_t size, uint64_t seed = 14695981039346656037ULL);
+
+inline uint64_t hashString(const std::string& str, uint64_t seed = 14695981039346656037ULL)
+{
+    return hashData(str.c_str(), str.length(), seed);
+}
+
+//spread bits of a hash, so hashes can be combined by addition
+inline uint64_t hashMix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
 } // namespace protogen
\ No newline at end of file
@@ -6,6 +6,33 @@
 
 const char* sccs_version = "@(#) protogen 1.8.0 " __DATE__;
 
+static void initProject(protogen::Project& prj)
+{
+    const char* envsp = getenv("PROTOGEN_SEARCH_PATH");
+    if(envsp)
+    {
+        std::string sp = envsp;
+        if(!sp.empty() && sp.back() != '/' && sp.back()!='\\')
+        {
+            sp += '/';
+        }
+        prj.addSearchPath(std::move(sp));
+    }
+    prj.setOutputFunc([](const char* msg){
+       printf("%s",msg);
+    });
+}
+
+static void printProfile(const std::string& traceFileName)
+{
+    using namespace protogen;
+    printf("%s", Profiler::report().c_str());
+    if(!traceFileName.empty() && !Profiler::writeTrace(traceFileName))
+    {
+        printf("Failed to write trace file '%s'\n", traceFileName.c_str());
+    }
+}
+
 int main(int argc, char* argv[])
 {
     using namespace protogen;
@@ -18,9 +45,42 @@ int main(int argc, char* argv[])
         }
         std::string projectFileName;
         StrVector optionsOverride;
+        bool watch = false;
+        bool profile = false;
+        std::string traceFileName;
+        std::string compileTemplate;
+        std::string compileOutput;
         for(int i = 1; i < argc; i++)
         {
             std::string option = argv[i];
+            if(option == "--watch")
+            {
+                watch = true;
+                continue;
+            }
+            if(option == "--profile" || option.substr(0, 10) == "--profile=")
+            {
+                profile = true;
+                traceFileName = option.substr(option.find('=') == std::string::npos ? option.length() : 10);
+                Profiler::enable();
+                continue;
+            }
+            if(option == "--profileTemplates")
+            {
+                profile = true;
+                Profiler::enableTemplates();
+                continue;
+            }
+            if(option.substr(0, 18) == "--compileTemplate=")
+            {
+                compileTemplate = option.substr(18);
+                continue;
+            }
+            if(option.substr(0, 16) == "--compileOutput=")
+            {
+                compileOutput = option.substr(16);
+                continue;
+            }
             if(option.substr(0, 2) == "--")
             {
                 optionsOverride.push_back(option.substr(2));
@@ -33,38 +93,69 @@ int main(int argc, char* argv[])
             }
             projectFileName = argv[i];
         }
+        if(compileTemplate.length())
+        {
+            //project is optional here, it only provides search paths
+            Project prj;
+            initProject(prj);
+            if(projectFileName.length() && !prj.load(projectFileName, optionsOverride))
+            {
+                printf("Failed to load project: '%s'\n", projectFileName.c_str());
+                return EXIT_FAILURE;
+            }
+            if(compileOutput.empty())
+            {
+                compileOutput = compileTemplate + ".cpp";
+            }
+            return prj.compileTemplate(compileTemplate, compileOutput) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
         if(!projectFileName.length())
         {
             printf("Expected project file name in command line\n");
             return EXIT_FAILURE;
         }
 
-        Project prj;
-
+        if(watch)
+        {
+            setvbuf(stdout, nullptr, _IOLBF, 0);
+        }
+        //in watch mode project is loaded again every time project file is changed
+        for(;;)
         {
-            const char* envsp = getenv("PROTOGEN_SEARCH_PATH");
-            if(envsp)
+            Project prj;
+            initProject(prj);
+            try
             {
-                std::string sp = envsp;
-                if(!sp.empty() && sp.back() != '/' && sp.back()!='\\')
+                if(!prj.load(projectFileName, optionsOverride))
                 {
-                    sp += '/';
+                    printf("Failed to load project: '%s'\n", projectFileName.c_str());
+                    return EXIT_FAILURE;
+                }
+                if(!prj.generate())
+                {
+                    printf("Failed to generate project: '%s'\n", projectFileName.c_str());
+                    if(!watch)
+                    {
+                        return EXIT_FAILURE;
+                    }
                 }
-                prj.addSearchPath(std::move(sp));
             }
-        }
-        prj.setOutputFunc([](const char* msg){
-           printf("%s",msg);
-        });
-        if(!prj.load(projectFileName, optionsOverride))
-        {
-            printf("Failed to load project: '%s'\n", projectFileName.c_str());
-            return EXIT_FAILURE;
-        }
-        if(!prj.generate())
-        {
-            printf("Failed to generate project: '%s'\n", projectFileName.c_str());
-            return EXIT_FAILURE;
+            catch(std::exception& e)
+            {
+                if(!watch)
+                {
+                    throw;
+                }
+                printf("Exception:\"%s\"\n", e.what());
+            }
+            if(profile)
+            {
+                printProfile(traceFileName);
+            }
+            if(!watch || !prj.watch())
+            {
+                break;
+            }
         }
     }
     catch(std::exception& e)